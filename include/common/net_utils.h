@@ -6,6 +6,10 @@
 void safe_send(const char* buf, int conn_fd, int len);
 void safe_recv(char* buf, int conn_fd);
 
+// Transfer exactly len bytes, return -1 on error or closed connection
+int send_all(const char* buf, int conn_fd, size_t len);
+int recv_all(char* buf, int conn_fd, size_t len);
+
 void send_status(int status, int client_fd);
 
 int recv_status(int conn_fd);
@@ -20,4 +24,18 @@ void send_success(const char* buf, int conn_fd);
 int recv_response(int conn_fd, int has_result);
 
 // Receive response and store it into buffer from outer scope
-int recv_store_response(int conn_fd, char* buf);
\ No newline at end of file
+int recv_store_response(int conn_fd, char* buf);
+
+// File content is transferred as a sequence of chunks of at most CHUNK_SIZE
+// bytes terminated by an empty chunk, so neither side keeps whole file in memory
+#define CHUNK_SIZE 65536
+
+// Send non-empty chunk, return -1 on error
+int send_chunk(const char* buf, int conn_fd, int len);
+
+// Finish transfer with an empty chunk
+int send_chunk_end(int conn_fd);
+
+// Receive next chunk into buf of max_len bytes, return its length,
+// 0 at the end of transfer and -1 on error or too long chunk
+int recv_chunk(char* buf, int conn_fd, int max_len);
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Requests are sent either as text lines or as binary frames. Text line is
+// prefixed by its length like any other message, binary frame starts with
+// PROTO_MAGIC, which is far above any line length, so every request is
+// recognized by its first 4 bytes. Integers are in host byte order, as
+// lengths in the rest of protocol
+
+#define PROTO_MAGIC 0x3153464D  // "MFS1"
+#define PROTO_MAX_ARGS 4
+#define PROTO_MAX_ARG_LEN 127  // paths are copied to 128-byte buffers by fs
+#define PROTO_LINE_LEN 1024
+#define PROTO_MAX_BATCH 65536
+
+enum opcode {
+    OP_INVALID = 0,
+    OP_QUIT,
+    OP_TOUCH,
+    OP_MKDIR,
+    OP_RM,
+    OP_RMDIR,
+    OP_CAT,
+    OP_LS,
+    OP_PUT,
+    OP_GET,
+    OP_BATCH,
+    OP_READ,
+    OP_WRITE,
+    OP_CD,
+    OP_PWD,
+    OP_OPEN,
+    OP_CLOSE,
+    OP_STATS,
+    OP_COUNT
+};
+
+// Arguments of arg_len bytes each follow the header without separators
+struct request_header {
+    uint32_t magic;
+    uint16_t opcode;
+    uint16_t arg_count;
+    uint32_t request_id;
+    uint16_t arg_len[PROTO_MAX_ARGS];
+};
+
+// OP_BATCH request has no arguments, header is followed by uint32_t count
+// of operations and then by operations, each is batch_op and path of len bytes
+struct batch_op {
+    uint16_t opcode;
+    uint16_t len;
+};
+
+// Sent before response to binary request, status and content follow it
+// as in text mode
+struct response_header {
+    uint32_t magic;
+    uint16_t opcode;
+    uint16_t reserved;
+    uint32_t request_id;
+};
+
+// Parsed request. Arguments are NUL-terminated and point into data,
+// so request is parsed without allocations
+struct request {
+    int binary;
+    enum opcode opcode;
+    uint32_t id;
+    size_t arg_count;  // may exceed PROTO_MAX_ARGS in text mode, extra ones are not stored
+    const char* args[PROTO_MAX_ARGS];
+    size_t arg_len[PROTO_MAX_ARGS];
+    char data[PROTO_LINE_LEN + 1];
+};
+
+// Command name used in text mode, NULL for OP_INVALID
+const char* opcode_name(enum opcode opcode);
+
+enum opcode opcode_by_name(const char* name, size_t len);
+
+// Send binary request with arguments of given lengths, return -1 on error
+int send_request(int conn_fd, enum opcode opcode, uint32_t request_id, const char* const* args,
+                 const size_t* arg_len, size_t arg_count);
+
+// Receive next request of either kind. Return 0 on success and -1 if connection
+// is closed or request is malformed (stream cannot be resynchronized then)
+int recv_request(int conn_fd, struct request* request);
+
+// Receive next operation of batch as request with path argument,
+// return -1 if connection is closed or operation is malformed
+int recv_batch_op(int conn_fd, struct request* op);
+
+// Answer binary request with header, nothing is sent for text one
+int send_response_header(int conn_fd, const struct request* request);
+
+// Receive header of response to request_id, return -1 if it does not match
+int recv_response_header(int conn_fd, uint32_t request_id);
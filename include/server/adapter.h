@@ -1,19 +1,62 @@
 #pragma once
 
 #include "common/net_utils.h"
-#include "common/tokenizer.h"
+#include "common/protocol.h"
 #include "server/fs.h"
 
-int perform_init(int disk_fd, int client_fd);
+#define MAX_HANDLES 16
 
-int perform_touch(struct tokenizer, int client_fd);
-int perform_mkdir(struct tokenizer, int client_fd);
+// File opened with `open`, reads and writes through it continue from offset
+struct handle {
+    int used;
+    struct fs_file file;
+    uint64_t offset;
+    uint64_t readahead;  // end of range prefetched for the next read
+};
 
-int perform_rm(struct tokenizer, int client_fd);
-int perform_rmdir(struct tokenizer, int client_fd);
+struct handle_table {
+    struct handle handles[MAX_HANDLES];
+};
 
-int perform_cat(struct tokenizer, int client_fd);
-int perform_ls(struct tokenizer, int client_fd);
+int perform_init(struct storage* disk, int client_fd, size_t cache_blocks, int format);
+int perform_shutdown();
 
-int perform_get(struct tokenizer, int client_fd);
-int perform_put(struct tokenizer, int client_fd);
\ No newline at end of file
+int perform_touch(const struct request* request, int client_fd);
+int perform_mkdir(const struct request* request, int client_fd);
+
+int perform_rm(const struct request* request, int client_fd);
+int perform_rmdir(const struct request* request, int client_fd);
+
+int perform_cat(const struct request* request, int client_fd);
+int perform_ls(const struct request* request, int client_fd);
+
+int perform_get(const struct request* request, int client_fd);
+int perform_put(const struct request* request, int client_fd);
+
+// Read or overwrite part of file at offset, only blocks of the range are touched.
+// With handle instead of path and offset, current offset of handle is used
+int perform_read(const struct request* request, int client_fd);
+int perform_write(const struct request* request, int client_fd);
+
+// Open files of session served by this thread
+void perform_set_handles(struct handle_table* table);
+
+// Resolve path once for reads and writes through returned handle
+int perform_open(const struct request* request, int client_fd);
+int perform_close(const struct request* request, int client_fd);
+
+// Working directory of session, relative paths of other commands start from it
+int perform_cd(const struct request* request, int client_fd);
+int perform_pwd(const struct request* request, int client_fd);
+
+struct stats;
+
+// Latency histograms of total followed by cache and journal counters as text lines,
+// cut to fit len bytes like snprintf. Return length of the whole text
+size_t format_stats(const struct stats* total, char* buf, size_t len);
+
+// Send latency histograms and counters of the server as text, the same way as file content
+int perform_stats(const struct request* request, int client_fd);
+
+// Apply touch/mkdir/rm/rmdir operations with one metadata flush
+int perform_batch(const struct request* request, int client_fd);
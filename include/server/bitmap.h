@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BITMAP_WORD_BITS 64
+#define BITMAP_WORDS(bits) (((bits) + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+
+// Packed bitmap of 64-bit words, the same layout is stored on disk.
+// Allocation is next-fit: search starts from the position after the last
+// allocated bit and wraps around.
+struct bitmap {
+    uint64_t* words;
+    size_t bit_count;
+    size_t word_count;
+    size_t hint;  // next-fit cursor
+};
+
+int bitmap_init(struct bitmap* bitmap, size_t bit_count);
+void bitmap_free(struct bitmap* bitmap);
+
+// Use words owned by caller, such bitmap must not be passed to bitmap_free
+void bitmap_attach(struct bitmap* bitmap, uint64_t* words, size_t bit_count);
+
+// Size of words array in bytes
+size_t bitmap_bytes(const struct bitmap* bitmap);
+
+int bitmap_test(const struct bitmap* bitmap, size_t bit);
+void bitmap_set(struct bitmap* bitmap, size_t bit);
+void bitmap_clear(struct bitmap* bitmap, size_t bit);
+void bitmap_clear_range(struct bitmap* bitmap, size_t start, size_t count);
+void bitmap_set_range(struct bitmap* bitmap, size_t start, size_t count);
+
+// Index of the first bit starting from from which is equal to value, or bit_count
+size_t bitmap_find_next(const struct bitmap* bitmap, size_t from, int value);
+
+// Find and set one free bit, return its index or -1
+ssize_t bitmap_alloc(struct bitmap* bitmap);
+
+// Find and set count contiguous free bits, return index of the first one or -1
+ssize_t bitmap_alloc_range(struct bitmap* bitmap, size_t count);
+
+// As bitmap_alloc_range, but if there is no run of max_count free bits, take the
+// longest one. Its length is stored to count
+ssize_t bitmap_alloc_longest(struct bitmap* bitmap, size_t max_count, size_t* count);
+
+// Set free bits starting exactly at start, stop at the first used bit or
+// after max_count bits. Return number of set bits
+size_t bitmap_alloc_at(struct bitmap* bitmap, size_t start, size_t max_count);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "server/storage.h"
+
+#define DEFAULT_CACHE_BLOCKS 1024
+#define MIN_CACHE_BLOCKS 8
+
+// Write-back cache of data region blocks keyed by block index.
+// Eviction uses CLOCK (second chance) algorithm. All functions except
+// init/free are thread-safe.
+struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    size_t capacity;
+    size_t used;
+    size_t dirty;
+};
+
+// capacity is measured in blocks. Directory and extent blocks are cached even
+// when data is read and written past the cache, so capacity cannot be zero.
+// At most meta_limit dirty metadata blocks are kept, writes of more fail
+int cache_init(struct storage* disk, off_t data_offset, size_t block_size, size_t capacity,
+               size_t meta_limit);
+void cache_free();
+
+// Access part of the block at block_index. Blocks written with meta set
+// (directories, extent blocks) are committed through journal and are never
+// written in place by cache
+int cache_read(int block_index, size_t offset, void* buf, size_t len);
+int cache_write(int block_index, size_t offset, const void* buf, size_t len, int meta);
+
+// Access count whole blocks starting from block_index with one storage call
+// where possible. Cached copies are used for reads and replaced by writes
+int cache_read_blocks(int block_index, int count, void* buf);
+int cache_write_blocks(int block_index, int count, const void* buf);
+
+// Write back dirty data blocks of range, so storage has their current content
+int cache_write_back_blocks(int block_index, int count);
+
+// Drop cached copy of block without writing it back (block was freed)
+void cache_invalidate(int block_index);
+
+// Write back dirty data blocks
+int cache_flush_data();
+
+// Pass every dirty metadata block to add, stop on error
+int cache_journal_meta(int (*add)(int block_index, const char* data));
+
+// Metadata blocks were written by journal
+void cache_mark_meta_clean();
+
+// Most dirty metadata blocks kept between commits
+size_t cache_meta_limit();
+
+struct cache_stats cache_get_stats();
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DCACHE_SIZE 4096
+
+// Cache of path components: (parent inode, name) -> inode.
+// Negative entries (inode -1) remember names that are missing in directory.
+// Each inode has a generation which is bumped when it is removed, so entries
+// inside removed directories and entries pointing to removed inodes expire
+// without scanning the table. All functions are thread-safe.
+int dcache_init(size_t inode_count);
+void dcache_free();
+
+// Return 1 and store result to inode (-1 for negative entry) on hit, 0 on miss
+int dcache_lookup(int parent, const char* name, int* inode);
+
+void dcache_insert(int parent, const char* name, int inode);
+void dcache_remove(int parent, const char* name);
+
+// Expire all entries inside inode and pointing to it
+void dcache_invalidate_inode(int inode);
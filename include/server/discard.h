@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "server/storage.h"
+
+// What happens to contents of freed data blocks. Nothing reads a block
+// before it is written by its new owner, so zeroing only keeps old data
+// out of the image and may be done off the request path
+enum discard_mode {
+    DISCARD_SYNC,      // zero blocks in commit which frees them
+    DISCARD_DEFERRED,  // zero blocks in background thread
+    DISCARD_LAZY,      // leave old contents until blocks are reused
+};
+
+// Parse mode name from command line ("sync", "deferred" or "lazy")
+int discard_parse_mode(const char* name, enum discard_mode* mode);
+
+// Mode used by the next discard_init
+void discard_set_mode(enum discard_mode mode);
+
+int discard_init(struct storage* disk, off_t data_offset, size_t block_size, uint32_t block_count);
+
+// Zero all pending blocks and stop background thread
+void discard_free();
+
+// Blocks are freed, called before they may be allocated again. They are
+// zeroed or queued by the next discard_commit
+void discard_blocks(uint32_t block_index, uint32_t count);
+
+// Metadata which frees blocks passed to discard_blocks is committed
+void discard_commit();
+
+// Blocks are allocated again. Pending zeroing is dropped, and if it is
+// running right now, it is finished before return
+void discard_cancel(uint32_t block_index, uint32_t count);
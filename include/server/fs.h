@@ -3,27 +3,91 @@
 #include <stdint.h>
 #include <stdio.h>
 
-#define ADDR_COUNT 6
+#include "server/bitmap.h"
+#include "server/storage.h"
+
+#define INODE_EXTENTS 4
 #define NAME_LEN 12
+#define FS_PATH_LEN 1024  // longest working directory path
+
+// Geometry used when disk is not formatted by mkfs.minifs
+#define DEFAULT_BLOCK_COUNT 60
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_INODE_COUNT 16
+#define DEFAULT_JOURNAL_BLOCKS 8
+#define DEFAULT_DISK_SIZE 73632  // size of character device provided by driver
 
-#define BLOCK_COUNT 64
-#define BLOCK_SIZE 1024
-#define INODE_COUNT 16
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
 #define MAGIC_NUMBER 0xEF53
 
+// Everything before superblock is reserved, other regions follow it
 #define SUPERBLOCK_OFFSET 1024
-#define BLOCK_BITMAP_OFFSET 1056
-#define INODE_BITMAP_OFFSET 1120
-#define INODE_TABLE_OFFSET 1136
-#define DATA_OFFSET 8096
+
+// Journal holds whole metadata region and at least this many dirty
+// directory and extent blocks in one transaction
+#define MIN_META_BLOCKS 4
+
+// Granularity of metadata dirty tracking
+#define SECTOR_SIZE 512
 
 #define DIR 0
 #define REG 1
+#define DIR_INDEX 2  // hash index of large directory, not linked to any directory
+
+// Inode flags
+#define INODE_INLINE 1  // data of regular file is stored in place of extents
+
+// Regular files start inline and move to blocks once they grow past this size
+#define INODE_INLINE_LEN (INODE_EXTENTS * sizeof(struct extent))
 
+// Run of contiguous data blocks
+struct extent {
+    uint32_t start;
+    uint32_t len;
+};
+
+// First INODE_EXTENTS extents are stored in inode, the rest of them
+// are stored in extent_block (which exists if extent_count > INODE_EXTENTS).
+// Inline file has no extents, its data takes the place of extents array
 struct inode {
-    int type;
-    int file_len;
-    int blocks_addr[ADDR_COUNT];
+    uint32_t type;
+    uint32_t flags;
+    uint64_t file_len;
+    uint32_t extent_count;
+    uint32_t extent_block;
+    uint32_t generation;  // bumped when inode is freed
+    uint32_t index_inode;  // hash index of directory, 0 if it has none
+    struct extent extents[INODE_EXTENTS];
+};
+
+// Inode index together with its generation at lookup time.
+// Operations through reference fail once the inode is removed
+struct inode_ref {
+    int index;
+    uint32_t generation;
+};
+
+// Position of the last used extent of file, so sequential access does not
+// scan extents from the first one on every call
+struct block_map {
+    int valid;
+    uint32_t version;  // blocks of inode were not released since it is cached
+    uint32_t extent;   // index of extent
+    uint32_t first;    // logical index of its first block
+};
+
+// Regular file opened by client
+struct fs_file {
+    struct inode_ref ref;
+    struct block_map map;
+};
+
+// Working directory of client. Relative paths are walked from the cached
+// inode, path is kept for pwd and for resolving ".."
+struct fs_cwd {
+    struct inode_ref ref;
+    char path[FS_PATH_LEN];  // absolute, without "." and ".." components
 };
 
 struct inode* get_inode(int inode_index);
@@ -41,33 +105,132 @@ struct superblock {
     uint32_t block_size;
     uint32_t inode_size;
     uint64_t magic_number;
+    uint32_t journal_blocks;
+    uint32_t reserved;
 };
 
+// Region offsets are not stored on disk, they are derived from superblock
+struct fs_layout {
+    off_t block_bitmap_offset;
+    off_t inode_bitmap_offset;
+    off_t inode_table_offset;
+    off_t metadata_end;    // end of inode table
+    off_t journal_offset;  // aligned to block size
+    off_t data_offset;
+    off_t disk_size;    // end of data region
+};
+
+void fs_compute_layout(const struct superblock* sb, struct fs_layout* layout);
+
+// Check that geometry in superblock is supported
+int fs_check_geometry(const struct superblock* sb);
+
+// Smallest journal which fits the largest metadata transaction of geometry
+uint32_t fs_min_journal_blocks(const struct superblock* sb);
+
 ssize_t get_free_inode_index();
 void free_inode(int inode_index);
 ssize_t get_free_block_index();
+// Allocate count contiguous blocks, return index of the first one
+ssize_t get_free_blocks(int count);
 void free_block(int block_index);
 
 int create_root();
 
+// Write back dirty data blocks, then commit dirty metadata sectors and
+// directory blocks through journal. Concurrent callers share one commit,
+// operations are paused while it captures metadata
 int dump_info();
 
 int load_info();
 
-int fs_init(int fs, int fd);
+// Create empty filesystem with given geometry on disk
+int fs_format(struct storage* disk, uint32_t block_size, uint32_t block_count,
+              uint32_t inode_count, uint32_t journal_blocks, size_t cache_blocks);
+
+// Mount filesystem stored on disk, replaying its journal
+int fs_mount(struct storage* disk, size_t cache_blocks);
+
+// Mount disk, or format it if it has no filesystem or format is set.
+// Geometry of existing filesystem is kept on format
+int fs_init(struct storage* disk, int fd, size_t cache_blocks, int format);
+
+// Write back cached blocks and metadata before server exit
+int fs_shutdown();
 
 int fs_open(FILE* stream);
 
+void free_blocks(int block_index, int count);
+
 // Write data to end of file associated with inode_index
-// If there is not enough blocks then add them
-int write_to_file(char* data, int len, int inode_index);
+// If there is not enough blocks then add them. Caller holds inode lock,
+// so error is not sent to client, only kept for fs_last_error
+int write_to_file(char* data, size_t len, int inode_index);
+
+int remove_inode(int inode_index);
+
+// Functions below lock filesystem themselves and may be called from many
+// threads: readers of one inode run in parallel, writers are exclusive.
+// They must not be called with filesystem locks held
+
+// Set cwd to root
+void fs_init_cwd(struct fs_cwd* cwd);
+
+// Working directory used by this thread for relative paths, NULL means root
+void fs_set_cwd(struct fs_cwd* cwd);
+
+// Change working directory of this thread to directory at path
+int change_dir(const char* path);
+
+// Path of working directory of this thread
+const char* current_dir();
+
+// Resolve path, store reference to inode and its copy if stat is not NULL
+int lookup_file(const char* path, struct inode_ref* ref, struct inode* stat);
 
-char* read_file(int inode_index);
+ssize_t find_file(const char* path);
 
-ssize_t find_file(char* path);
+// Write data at offset which is not beyond end of file, extending it if needed
+int write_range(const struct inode_ref* ref, uint64_t offset, const char* data, size_t len);
+
+// Read up to len bytes from offset, return number of bytes read or -1
+ssize_t read_range(const struct inode_ref* ref, uint64_t offset, char* buf, size_t len);
+
+// Copy inode of ref, fail if it was removed
+int stat_file(const struct inode_ref* ref, struct inode* stat);
+
+// Resolve path once for the following *_at calls, which reuse block map of file
+int open_file(const char* path, struct fs_file* file, struct inode* stat);
+
+// As read_range and write_range
+ssize_t read_at(struct fs_file* file, uint64_t offset, char* buf, size_t len);
+int write_at(struct fs_file* file, uint64_t offset, const char* data, size_t len);
+
+// Content of files can be sent straight from image with sendfile_at
+int fs_zero_copy();
+
+// Send up to len bytes from offset to non-blocking socket out_fd without copying
+// them through user space. Return number of bytes sent, 0 at the end of file and
+// -1 on error; errno is EAGAIN if socket is full and ENOENT if file was removed
+ssize_t sendfile_at(struct fs_file* file, uint64_t offset, size_t len, int out_fd);
+
+// Start fetching blocks of range from disk in background before it is read
+void prefetch_range(const struct inode_ref* ref, uint64_t offset, size_t len);
+
+// Cut file to new_len bytes, releasing blocks after it
+int truncate_file(const struct inode_ref* ref, uint64_t new_len);
+
+// Read whole file and store its length to len, NULL if file was removed
+char* read_file(const struct inode_ref* ref, uint64_t* len);
 
 int create_at(char* path, int type, char* content);
 
-int remove_inode(int inode_index);
+int remove_at(char* path);
+
+// Operations between begin and end are committed by a single metadata flush
+// at the end, their errors are not sent to client but kept for fs_last_error
+void fs_batch_begin();
+int fs_batch_end();
 
-int remove_at(char* path);
\ No newline at end of file
+// Message of the last error of calling thread
+const char* fs_last_error();
\ No newline at end of file
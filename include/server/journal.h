@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "server/storage.h"
+
+#define JOURNAL_MAGIC 0x4C4E524A53464D4DULL  // "MMFSJRNL"
+
+// Transaction layout in journal region:
+// header, record_count records, then payloads of all records one after another.
+// Transaction is valid only if checksum of records and payloads matches, so
+// partially written transaction is ignored on recovery.
+struct journal_header {
+    uint64_t magic;
+    uint64_t sequence;
+    uint32_t record_count;
+    uint32_t reserved;
+    uint64_t payload_len;
+    uint64_t checksum;
+};
+
+// Payload of record should be written to offset on disk
+struct journal_record {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+struct journal_stats {
+    uint64_t commits;
+    uint64_t records;
+    uint64_t bytes;
+};
+
+// Journal occupies [offset, offset + size) on disk, zero size disables it:
+// then every record is written in place at commit without atomicity
+int journal_init(struct storage* disk, off_t offset, size_t size);
+void journal_free();
+
+// Start collecting records of a new transaction
+void journal_begin();
+
+// Add record to current transaction, return -1 if it does not fit into journal
+int journal_add(off_t offset, const void* data, size_t len);
+
+// Make transaction durable in journal, then write records to their places
+int journal_commit();
+
+// Apply transaction left in journal by unclean shutdown
+int journal_replay();
+
+struct journal_stats journal_get_stats();
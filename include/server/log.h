@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#define LOG_CAPACITY 4096  // messages waiting for writer thread, power of two
+#define LOG_LINE_LEN 256   // longer messages are cut
+
+enum log_level {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+};
+
+// Parse level name from command line ("debug", "info", "warn" or "error")
+int log_parse_level(const char* name, enum log_level* level);
+
+// Append messages of level and above to file at path. Writer thread is
+// stopped and remaining messages are written at exit
+int log_init(const char* path, enum log_level level);
+
+// Format message into a free slot of the ring and return, it is written to
+// file by background thread. Callers never wait: when ring is full, message
+// is dropped and counted. Before log_init messages go to stderr
+void log_write(enum log_level level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Messages dropped because ring was full
+uint64_t log_dropped();
+
+// Write all queued messages and stop writer thread
+void log_free();
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "server/adapter.h"
+
+#define DEFAULT_WORKERS 4
+#define DEFAULT_MAX_CLIENTS 4096
+
+// Connected client. Only one worker handles session at a time
+struct session {
+    int fd;
+    int user_id;
+    int greeted;  // user id is already received
+    struct fs_cwd cwd;
+    struct handle_table handles;
+};
+
+struct reactor_config {
+    size_t workers;      // size of worker pool
+    size_t max_clients;  // connections above the limit are closed right after accept
+};
+
+// Handle one request of session, return -1 to close connection
+typedef int (*request_handler)(struct session* session);
+
+// Wait for readable connections with epoll and pass them to the pool of workers.
+// listen_fd is a listening socket, function returns only on error
+int reactor_run(int listen_fd, const struct reactor_config* config, request_handler handler);
+
+// Let workers finish requests they are handling and join them, so filesystem
+// can be shut down. Connections stay open until exit
+void reactor_stop();
+
+// Number of currently connected clients
+size_t reactor_client_count();
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/protocol.h"
+
+// Latencies are counted in buckets of powers of two nanoseconds: bucket i
+// holds values below 2^i, the last one takes everything above
+#define STATS_BUCKETS 32
+
+// Measured events besides requests, which are kept per opcode
+enum stats_event {
+    STATS_DEVICE_READ,   // storage reads and sendfile, units are bytes
+    STATS_DEVICE_WRITE,  // storage writes, units are bytes
+    STATS_BLOCK_ALLOC,   // units are blocks
+    STATS_BLOCK_FREE,
+    STATS_INODE_ALLOC,
+    STATS_INODE_FREE,
+    STATS_FLUSH,  // dump_info calls, including wait for shared commit
+    STATS_EVENT_COUNT
+};
+
+struct histogram {
+    uint64_t count;
+    uint64_t units;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+// Every thread counts into its own shard, so recording takes no locks and
+// shares no cache lines. Readers sum shards of all threads
+struct stats {
+    struct histogram requests[OP_COUNT];
+    struct histogram events[STATS_EVENT_COUNT];
+};
+
+// Monotonic time to pass as start of measurement
+uint64_t stats_now();
+
+// Event started at start is finished now
+void stats_record(enum stats_event event, uint64_t start, uint64_t units);
+void stats_record_request(enum opcode opcode, uint64_t start);
+
+// Sum counters of all threads
+void stats_collect(struct stats* total);
+
+// Print non-empty histograms of total as text lines, return length of text
+// (it is cut to fit len bytes like snprintf)
+size_t stats_format(const struct stats* total, char* buf, size_t len);
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Ways to access the filesystem image
+enum storage_kind {
+    STORAGE_PIO,   // positional read/write (pread/pwrite) on device or image file
+    STORAGE_MMAP,  // regular image file mapped into server memory
+    STORAGE_MEMORY,  // anonymous memory, contents are lost on close (for benchmarks)
+};
+
+struct storage;
+
+struct storage_ops {
+    ssize_t (*read)(struct storage* storage, void* buf, size_t len, off_t offset);
+    ssize_t (*write)(struct storage* storage, const void* buf, size_t len, off_t offset);
+    int (*sync)(struct storage* storage);
+    void (*prefetch)(struct storage* storage, off_t offset, size_t len);
+    int (*discard)(struct storage* storage, off_t offset, size_t len);
+    ssize_t (*send)(struct storage* storage, int out_fd, off_t offset, size_t len);
+    void (*close)(struct storage* storage);
+};
+
+struct storage {
+    const struct storage_ops* ops;
+    enum storage_kind kind;
+    int fd;
+    char* map;    // only for STORAGE_MMAP and STORAGE_MEMORY
+    size_t size;  // size of the image in bytes
+    int regular;  // image is a regular file, so storage_send works
+};
+
+// Parse backend name from command line ("pio" or "mmap")
+int storage_parse_kind(const char* name, enum storage_kind* kind);
+
+// Open image at path. Regular files smaller than size are extended,
+// size of bigger regular files is taken from the file itself
+int storage_open(struct storage* storage, const char* path, enum storage_kind kind, size_t size);
+
+// Create zero-filled image of size bytes in memory, it has no descriptor
+int storage_open_memory(struct storage* storage, size_t size);
+
+// Read/write exactly len bytes at offset, return len on success and -1 on error
+ssize_t storage_read(struct storage* storage, void* buf, size_t len, off_t offset);
+ssize_t storage_write(struct storage* storage, const void* buf, size_t len, off_t offset);
+
+int storage_sync(struct storage* storage);
+
+// Hint that range will be read soon, so it is fetched in background
+void storage_prefetch(struct storage* storage, off_t offset, size_t len);
+
+// Fill range with zeros, holes are punched in image files instead of writing
+int storage_discard(struct storage* storage, off_t offset, size_t len);
+
+// Send range of image to socket without copying it through user space,
+// return number of bytes sent or -1 (errno is EAGAIN for full non-blocking socket)
+ssize_t storage_send(struct storage* storage, int out_fd, off_t offset, size_t len);
+
+void storage_close(struct storage* storage);
@@ -0,0 +1,478 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/net_utils.h"
+#include "common/protocol.h"
+
+#define MAX_CONNECTIONS 1024
+#define MAX_LIVE 1024  // files or directories kept by one connection
+
+#define DEFAULT_MIX "touch:20,mkdir:5,ls:20,cat:20,get:10,put:10,rm:15"
+
+// Operations benchmark can replay, weights of others are always 0
+static const enum opcode bench_ops[] = {OP_TOUCH, OP_MKDIR, OP_LS, OP_CAT,
+                                        OP_GET,   OP_PUT,   OP_RM};
+#define BENCH_OP_COUNT (sizeof(bench_ops) / sizeof(bench_ops[0]))
+
+// Latencies of one operation type, in nanoseconds
+struct samples {
+    uint64_t* ns;
+    size_t count;
+    size_t capacity;
+    uint64_t errors;
+};
+
+// Connection replaying the mix. It works in its own directory /b<id>, so
+// connections do not touch names of each other
+struct worker {
+    pthread_t thread;
+    int id;
+    int fd;
+    uint32_t request_id;
+    unsigned int seed;
+    int broken;  // connection is lost, the rest of operations are skipped
+    uint64_t end_ns;  // measured operations are finished
+
+    uint32_t files[MAX_LIVE];
+    size_t file_count;
+    uint32_t dirs[MAX_LIVE];
+    size_t dir_count;
+    uint32_t next_name;
+
+    struct samples samples[OP_COUNT];
+};
+
+static const char* server_ip = "127.0.0.1";
+static int server_port = 8080;
+static size_t connection_count = 8;
+static uint64_t ops_per_connection = 1000;
+static double duration;  // seconds, replaces ops_per_connection if set
+static size_t file_size = 4096;
+static size_t max_live = 32;
+
+static unsigned int weights[OP_COUNT];
+static unsigned int weight_sum;
+
+static char* content;  // sent by get
+static pthread_barrier_t start_barrier;
+static uint64_t start_ns;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Parse "op:weight,..." list, operations not in it are not sent
+static int parse_mix(const char* mix) {
+    memset(weights, 0, sizeof(weights));
+    weight_sum = 0;
+    const char* pos = mix;
+    while (*pos != '\0') {
+        const char* colon = strchr(pos, ':');
+        if (colon == NULL) {
+            return -1;
+        }
+        enum opcode opcode = opcode_by_name(pos, (size_t)(colon - pos));
+        int known = 0;
+        for (size_t i = 0; i < BENCH_OP_COUNT; ++i) {
+            known |= (bench_ops[i] == opcode);
+        }
+        char* end = NULL;
+        unsigned long weight = strtoul(colon + 1, &end, 10);
+        if (!known || end == colon + 1 || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        weights[opcode] = (unsigned int)weight;
+        weight_sum += (unsigned int)weight;
+        pos = (*end == ',') ? end + 1 : end;
+    }
+    return (weight_sum > 0) ? 0 : -1;
+}
+
+static enum opcode pick_op(struct worker* worker) {
+    unsigned int value = (unsigned int)rand_r(&worker->seed) % weight_sum;
+    for (size_t i = 0; i < BENCH_OP_COUNT; ++i) {
+        if (value < weights[bench_ops[i]]) {
+            return bench_ops[i];
+        }
+        value -= weights[bench_ops[i]];
+    }
+    return bench_ops[0];
+}
+
+static int add_sample(struct samples* samples, uint64_t ns) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = (samples->capacity == 0) ? 1024 : 2 * samples->capacity;
+        uint64_t* ns_array = realloc(samples->ns, capacity * sizeof(uint64_t));
+        if (ns_array == NULL) {
+            return -1;
+        }
+        samples->ns = ns_array;
+        samples->capacity = capacity;
+    }
+    samples->ns[samples->count++] = ns;
+    return 0;
+}
+
+static int connect_to_server(const char* ip, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    // Requests are sent in several writes, Nagle would hold back all but the first
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &serv_addr.sin_addr) != 1) {
+        fprintf(stderr, "bad server address %s\n", ip);
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)(&serv_addr), sizeof(serv_addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Result of request: 0 on success, 1 if server answered with failure,
+// -1 if connection is broken
+static int recv_answer(struct worker* worker, int has_result) {
+    if (recv_response_header(worker->fd, worker->request_id) != 0) {
+        return -1;
+    }
+    int status = recv_status(worker->fd);
+    if (status == 1 && !has_result) {
+        return 0;
+    }
+    char response[CHUNK_SIZE];
+    safe_recv(response, worker->fd);
+    return (status == 1) ? 0 : 1;
+}
+
+// Drain file content sent by cat and put
+static int recv_content(struct worker* worker) {
+    if (recv_response_header(worker->fd, worker->request_id) != 0) {
+        return -1;
+    }
+    char response[CHUNK_SIZE];
+    if (recv_status(worker->fd) != 1) {
+        safe_recv(response, worker->fd);
+        return 1;
+    }
+    int len;
+    while ((len = recv_chunk(response, worker->fd, sizeof(response))) > 0) {
+    }
+    return (len < 0) ? -1 : 0;
+}
+
+static int send_args(struct worker* worker, enum opcode opcode, const char* first,
+                     const char* second) {
+    const char* args[2] = {first, second};
+    size_t arg_len[2] = {strlen(first), (second != NULL) ? strlen(second) : 0};
+    size_t arg_count = (second != NULL) ? 2 : 1;
+    return send_request(worker->fd, opcode, ++worker->request_id, args, arg_len, arg_count);
+}
+
+static int run_request(struct worker* worker, enum opcode opcode, const char* path) {
+    char dir[16];
+    snprintf(dir, sizeof(dir), "/b%d", worker->id);
+    switch (opcode) {
+        case OP_CAT:
+            return (send_args(worker, opcode, path, NULL) == 0) ? recv_content(worker) : -1;
+        case OP_PUT:
+            // Content is drained, client side of put writes it to a local file
+            return (send_args(worker, opcode, path, "bench") == 0) ? recv_content(worker) : -1;
+        case OP_GET:
+            if (send_args(worker, opcode, "bench", path) != 0) {
+                return -1;
+            }
+            for (size_t pos = 0; pos < file_size; pos += CHUNK_SIZE) {
+                size_t len = (file_size - pos < CHUNK_SIZE) ? file_size - pos : CHUNK_SIZE;
+                if (send_chunk(content + pos, worker->fd, (int)len) != 0) {
+                    return -1;
+                }
+            }
+            return (send_chunk_end(worker->fd) == 0) ? recv_answer(worker, 0) : -1;
+        case OP_LS:
+            return (send_args(worker, opcode, dir, NULL) == 0) ? recv_content(worker) : -1;
+        default:
+            return (send_args(worker, opcode, path, NULL) == 0) ? recv_answer(worker, 0) : -1;
+    }
+}
+
+static void name_path(struct worker* worker, char prefix, uint32_t name, char* path) {
+    snprintf(path, PROTO_MAX_ARG_LEN, "/b%d/%c%u", worker->id, prefix, name);
+}
+
+// Take random name out of set, order of names does not matter
+static uint32_t take_name(struct worker* worker, uint32_t* names, size_t* count) {
+    size_t index = (size_t)rand_r(&worker->seed) % *count;
+    uint32_t name = names[index];
+    names[index] = names[--*count];
+    return name;
+}
+
+// Prepare state needed by operation with requests which are not measured:
+// free a slot before creating a name, create a file before using one.
+// Path of operation is stored to path
+static int prepare(struct worker* worker, enum opcode opcode, char* path) {
+    if (opcode == OP_TOUCH || opcode == OP_GET || opcode == OP_MKDIR) {
+        int is_dir = (opcode == OP_MKDIR);
+        uint32_t* names = is_dir ? worker->dirs : worker->files;
+        size_t* count = is_dir ? &worker->dir_count : &worker->file_count;
+        if (*count == max_live) {
+            name_path(worker, is_dir ? 'd' : 'f', take_name(worker, names, count), path);
+            if (run_request(worker, is_dir ? OP_RMDIR : OP_RM, path) < 0) {
+                return -1;
+            }
+        }
+        uint32_t name = worker->next_name++;
+        names[(*count)++] = name;
+        name_path(worker, is_dir ? 'd' : 'f', name, path);
+        return 0;
+    }
+    if (opcode == OP_CAT || opcode == OP_PUT || opcode == OP_RM) {
+        if (worker->file_count == 0) {
+            uint32_t name = worker->next_name++;
+            worker->files[worker->file_count++] = name;
+            name_path(worker, 'f', name, path);
+            if (run_request(worker, OP_GET, path) < 0) {
+                return -1;
+            }
+        }
+        size_t index = (size_t)rand_r(&worker->seed) % worker->file_count;
+        uint32_t name = (opcode == OP_RM) ? take_name(worker, worker->files, &worker->file_count)
+                                          : worker->files[index];
+        name_path(worker, 'f', name, path);
+    }
+    return 0;
+}
+
+// Remove everything created by worker, so the next run starts from empty directory
+static void clean_up(struct worker* worker) {
+    char path[PROTO_MAX_ARG_LEN + 1];
+    while (worker->file_count > 0 && !worker->broken) {
+        name_path(worker, 'f', worker->files[--worker->file_count], path);
+        worker->broken = (run_request(worker, OP_RM, path) < 0);
+    }
+    while (worker->dir_count > 0 && !worker->broken) {
+        name_path(worker, 'd', worker->dirs[--worker->dir_count], path);
+        worker->broken = (run_request(worker, OP_RMDIR, path) < 0);
+    }
+    snprintf(path, sizeof(path), "/b%d", worker->id);
+    if (!worker->broken) {
+        run_request(worker, OP_RMDIR, path);
+    }
+}
+
+static void* run_worker(void* arg) {
+    struct worker* worker = arg;
+    char dir[16];
+    snprintf(dir, sizeof(dir), "/b%d", worker->id);
+    if (run_request(worker, OP_MKDIR, dir) < 0) {
+        worker->broken = 1;
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    uint64_t deadline = start_ns + (uint64_t)(duration * 1e9);
+    for (uint64_t done = 0; !worker->broken; ++done) {
+        if ((duration > 0) ? now_ns() >= deadline : done == ops_per_connection) {
+            break;
+        }
+
+        enum opcode opcode = pick_op(worker);
+        char path[PROTO_MAX_ARG_LEN + 1];
+        if (prepare(worker, opcode, path) != 0) {
+            worker->broken = 1;
+            break;
+        }
+
+        uint64_t begin = now_ns();
+        int result = run_request(worker, opcode, path);
+        uint64_t end = now_ns();
+        if (result < 0) {
+            worker->broken = 1;
+            break;
+        }
+        struct samples* samples = &worker->samples[opcode];
+        samples->errors += (result != 0);
+        if (add_sample(samples, end - begin) != 0) {
+            worker->broken = 1;
+        }
+    }
+    worker->end_ns = now_ns();
+    clean_up(worker);
+    return NULL;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples, in microseconds
+static double percentile(const struct samples* samples, double fraction) {
+    size_t rank = (size_t)(fraction * (double)samples->count + 0.999999);
+    rank = (rank == 0) ? 1 : rank;
+    return (double)samples->ns[rank - 1] / 1000.0;
+}
+
+static void print_report(struct worker* workers, double seconds) {
+    struct samples total[OP_COUNT];
+    memset(total, 0, sizeof(total));
+    uint64_t op_count = 0;
+    for (size_t i = 0; i < BENCH_OP_COUNT; ++i) {
+        enum opcode opcode = bench_ops[i];
+        for (size_t w = 0; w < connection_count; ++w) {
+            struct samples* samples = &workers[w].samples[opcode];
+            for (size_t s = 0; s < samples->count; ++s) {
+                add_sample(&total[opcode], samples->ns[s]);
+            }
+            total[opcode].errors += samples->errors;
+        }
+        op_count += total[opcode].count;
+    }
+
+    printf("%zu connections, %llu operations in %.3f s, %.1f ops/s\n", connection_count,
+           (unsigned long long)op_count, seconds, (double)op_count / seconds);
+    printf("%-6s %10s %8s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "ops/s",
+           "p50 us", "p99 us", "p999 us", "max us");
+    for (size_t i = 0; i < BENCH_OP_COUNT; ++i) {
+        struct samples* samples = &total[bench_ops[i]];
+        if (samples->count == 0) {
+            continue;
+        }
+        qsort(samples->ns, samples->count, sizeof(uint64_t), compare_u64);
+        printf("%-6s %10zu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", opcode_name(bench_ops[i]),
+               samples->count, (unsigned long long)samples->errors,
+               (double)samples->count / seconds, percentile(samples, 0.5),
+               percentile(samples, 0.99), percentile(samples, 0.999),
+               (double)samples->ns[samples->count - 1] / 1000.0);
+        free(samples->ns);
+    }
+}
+
+static void print_usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [-c connections = 8] [-n operations per connection = 1000] "
+            "[-d duration in seconds] [-m mix = %s] [-s file size = 4096] "
+            "[-f live files per connection = 32] [ip = 127.0.0.1] [port = 8080]\n",
+            name, DEFAULT_MIX);
+}
+
+int main(int argc, char** argv) {
+    const char* mix = DEFAULT_MIX;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:d:m:s:f:")) != -1) {
+        if (opt == 'c') {
+            connection_count = (size_t)strtoul(optarg, 0, 10);
+        } else if (opt == 'n') {
+            ops_per_connection = strtoull(optarg, 0, 10);
+        } else if (opt == 'd') {
+            duration = strtod(optarg, 0);
+        } else if (opt == 'm') {
+            mix = optarg;
+        } else if (opt == 's') {
+            file_size = (size_t)strtoul(optarg, 0, 10);
+        } else if (opt == 'f') {
+            max_live = (size_t)strtoul(optarg, 0, 10);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        server_ip = argv[optind++];
+    }
+    if (optind < argc) {
+        server_port = (int)strtol(argv[optind++], 0, 10);
+    }
+    if (connection_count == 0 || connection_count > MAX_CONNECTIONS) {
+        fprintf(stderr, "Connection count must be from 1 to %d\n", MAX_CONNECTIONS);
+        return 1;
+    }
+    if (max_live == 0 || max_live > MAX_LIVE) {
+        fprintf(stderr, "Live file count must be from 1 to %d\n", MAX_LIVE);
+        return 1;
+    }
+    if (parse_mix(mix) != 0) {
+        fprintf(stderr, "Bad mix %s, expected list of op:weight with ops %s\n", mix,
+                "touch, mkdir, ls, cat, get, put, rm");
+        return 1;
+    }
+
+    content = malloc(file_size + 1);
+    struct worker* workers = calloc(connection_count, sizeof(struct worker));
+    if (content == NULL || workers == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < file_size; ++i) {
+        content[i] = (char)('a' + i % 26);
+    }
+
+    for (size_t i = 0; i < connection_count; ++i) {
+        struct worker* worker = &workers[i];
+        worker->id = (int)i;
+        worker->seed = (unsigned int)i + 1;
+        worker->fd = connect_to_server(server_ip, server_port);
+        if (worker->fd < 0) {
+            fprintf(stderr, "Cannot connect to server, exit...\n");
+            return 1;
+        }
+        safe_send("1", worker->fd, -1);
+        if (recv_status(worker->fd) != 1) {
+            fprintf(stderr, "Server rejected connection %zu\n", i);
+            return 1;
+        }
+    }
+
+    // Clock starts once every connection is ready
+    pthread_barrier_init(&start_barrier, NULL, (unsigned int)connection_count + 1);
+    for (size_t i = 0; i < connection_count; ++i) {
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    start_ns = now_ns();
+    pthread_barrier_wait(&start_barrier);
+    size_t broken = 0;
+    uint64_t end_ns = start_ns;
+    for (size_t i = 0; i < connection_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        broken += (size_t)workers[i].broken;
+        end_ns = (workers[i].end_ns > end_ns) ? workers[i].end_ns : end_ns;
+    }
+    double seconds = (double)(end_ns - start_ns) / 1e9;
+
+    print_report(workers, seconds);
+    if (broken > 0) {
+        fprintf(stderr, "%zu connections were lost\n", broken);
+    }
+
+    for (size_t i = 0; i < connection_count; ++i) {
+        for (size_t op = 0; op < OP_COUNT; ++op) {
+            free(workers[i].samples[op].ns);
+        }
+        close(workers[i].fd);
+    }
+    free(workers);
+    free(content);
+    pthread_barrier_destroy(&start_barrier);
+    return (broken > 0) ? 1 : 0;
+}
@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server/cache.h"
+#include "server/fs.h"
+#include "server/stats.h"
+
+#define DEFAULT_IMAGE_SIZE (256ull << 20)
+#define READ_FILE_SIZE 65536
+#define ALLOC_RUN 16  // blocks taken by one get_free_blocks call
+#define SMALL_FILE_SIZE 16
+
+// Filesystem code reports errors to the current client
+_Thread_local int client_fd = -1;
+
+static size_t op_count = 10000;
+static size_t write_size = 4096;
+static long long own_calls;  // made by syscall_count itself
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Read and write system calls made by process so far (syscr + syscw of
+// /proc/self/io), -1 if kernel does not account them
+static long long syscall_count() {
+    FILE* io = fopen("/proc/self/io", "r");
+    if (io == NULL) {
+        return -1;
+    }
+    char line[128];
+    long long count = 0;
+    int found = 0;
+    while (fgets(line, sizeof(line), io) != NULL) {
+        long long value;
+        if (sscanf(line, "syscr: %lld", &value) == 1 || sscanf(line, "syscw: %lld", &value) == 1) {
+            count += value;
+            ++found;
+        }
+    }
+    fclose(io);
+    return (found == 2) ? count : -1;
+}
+
+struct measure {
+    uint64_t start_ns;
+    long long start_calls;
+};
+
+static void begin(struct measure* measure) {
+    measure->start_calls = syscall_count();
+    measure->start_ns = now_ns();
+}
+
+static void report(const char* name, const struct measure* measure, size_t ops) {
+    uint64_t ns = now_ns() - measure->start_ns;
+    long long calls = syscall_count();
+    if (measure->start_calls < 0 || calls < 0) {
+        printf("%-28s %12.1f %12s\n", name, (double)ns / (double)ops, "-");
+        return;
+    }
+    calls -= measure->start_calls + own_calls;
+    printf("%-28s %12.1f %12.2f\n", name, (double)ns / (double)ops,
+           (double)(calls > 0 ? calls : 0) / (double)ops);
+}
+
+static void file_path(char* path, size_t index) {
+    snprintf(path, 128, "/m/f%zu", index);
+}
+
+static int bench_create(void) {
+    char path[128];
+    struct measure measure;
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        file_path(path, i);
+        if (create_at(path, REG, NULL) != 0) {
+            fprintf(stderr, "create_at %s: %s\n", path, fs_last_error());
+            return -1;
+        }
+    }
+    report("create_at", &measure, op_count);
+    return 0;
+}
+
+static int bench_find(void) {
+    char path[128];
+    unsigned int seed = 1;
+    struct measure measure;
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        file_path(path, (size_t)rand_r(&seed) % op_count);
+        if (find_file(path) < 0) {
+            fprintf(stderr, "find_file %s: not found\n", path);
+            return -1;
+        }
+    }
+    report("find_file", &measure, op_count);
+    return 0;
+}
+
+static int bench_remove(void) {
+    char path[128];
+    struct measure measure;
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        file_path(path, i);
+        if (remove_at(path) != 0) {
+            fprintf(stderr, "remove_at %s: %s\n", path, fs_last_error());
+            return -1;
+        }
+    }
+    report("remove_at", &measure, op_count);
+    return 0;
+}
+
+static uint64_t allocated_blocks() {
+    struct stats total;
+    stats_collect(&total);
+    return total.events[STATS_BLOCK_ALLOC].units;
+}
+
+// Files of a few bytes are kept in their inodes, so they take no blocks and
+// their reads do not touch storage
+static int bench_small(void) {
+    char path[128];
+    char content[SMALL_FILE_SIZE + 1];
+    memset(content, 's', SMALL_FILE_SIZE);
+    content[SMALL_FILE_SIZE] = '\0';
+    struct inode_ref* refs = malloc(op_count * sizeof(struct inode_ref));
+    if (refs == NULL) {
+        return -1;
+    }
+
+    uint64_t blocks = allocated_blocks();
+    struct measure measure;
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        snprintf(path, sizeof(path), "/m/s%zu", i);
+        if (create_at(path, REG, content) != 0 || lookup_file(path, &refs[i], NULL) != 0) {
+            fprintf(stderr, "create_at %s: %s\n", path, fs_last_error());
+            free(refs);
+            return -1;
+        }
+    }
+    report("create_at (16 B content)", &measure, op_count);
+
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        uint64_t len;
+        char* data = read_file(&refs[i], &len);
+        if (data == NULL || len != SMALL_FILE_SIZE) {
+            fprintf(stderr, "read_file: bad content\n");
+            free(data);
+            free(refs);
+            return -1;
+        }
+        free(data);
+    }
+    report("read_file (16 B)", &measure, op_count);
+    printf("%-28s %12.2f\n", "  data blocks per file",
+           (double)(allocated_blocks() - blocks) / (double)op_count);
+    free(refs);
+    return 0;
+}
+
+// Benchmark runs in one thread, so inode locks required by write_to_file are not taken
+static int bench_write(void) {
+    char path[] = "/data";
+    if (create_at(path, REG, NULL) != 0) {
+        return -1;
+    }
+    ssize_t inode_index = find_file(path);
+    char* data = malloc(write_size);
+    if (inode_index < 0 || data == NULL) {
+        free(data);
+        return -1;
+    }
+    memset(data, 'w', write_size);
+
+    char name[64];
+    snprintf(name, sizeof(name), "write_to_file (%zu B)", write_size);
+    struct measure measure;
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        if (write_to_file(data, write_size, (int)inode_index) != 0) {
+            fprintf(stderr, "write_to_file: %s\n", fs_last_error());
+            free(data);
+            return -1;
+        }
+    }
+    report(name, &measure, op_count);
+    free(data);
+    return 0;
+}
+
+static int bench_read(void) {
+    char path[] = "/read";
+    char* data = malloc(READ_FILE_SIZE);
+    if (data == NULL || create_at(path, REG, NULL) != 0) {
+        free(data);
+        return -1;
+    }
+    memset(data, 'r', READ_FILE_SIZE);
+    struct inode_ref ref;
+    if (lookup_file(path, &ref, NULL) != 0 ||
+        write_range(&ref, 0, data, READ_FILE_SIZE) != 0) {
+        free(data);
+        return -1;
+    }
+    free(data);
+
+    struct measure measure;
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        uint64_t len;
+        char* content = read_file(&ref, &len);
+        if (content == NULL || len != READ_FILE_SIZE) {
+            fprintf(stderr, "read_file: bad content\n");
+            free(content);
+            return -1;
+        }
+        free(content);
+    }
+    report("read_file (64 KiB)", &measure, op_count);
+    return 0;
+}
+
+static int bench_alloc(void) {
+    struct measure measure;
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        ssize_t block = get_free_block_index();
+        if (block < 0) {
+            return -1;
+        }
+        free_block((int)block);
+    }
+    report("get_free_block_index+free", &measure, op_count);
+
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        ssize_t block = get_free_blocks(ALLOC_RUN);
+        if (block < 0) {
+            return -1;
+        }
+        free_blocks((int)block, ALLOC_RUN);
+    }
+    report("get_free_blocks(16)+free", &measure, op_count);
+
+    begin(&measure);
+    for (size_t i = 0; i < op_count; ++i) {
+        ssize_t inode = get_free_inode_index();
+        if (inode < 0) {
+            return -1;
+        }
+        free_inode((int)inode);
+    }
+    report("get_free_inode_index+free", &measure, op_count);
+    return 0;
+}
+
+static void print_usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [-n operations = 10000] [-b block size = 4096] [-c cache blocks = 1024] "
+            "[-w write size = 4096] [-d image] [-s pio|mmap]\n"
+            "Without -d the filesystem is kept in memory\n",
+            name);
+}
+
+int main(int argc, char** argv) {
+    uint32_t block_size = 4096;
+    size_t cache_blocks = 1024;
+    const char* image = NULL;
+    enum storage_kind kind = STORAGE_PIO;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:c:w:d:s:")) != -1) {
+        if (opt == 'n') {
+            op_count = (size_t)strtoul(optarg, 0, 10);
+        } else if (opt == 'b') {
+            block_size = (uint32_t)strtoul(optarg, 0, 10);
+        } else if (opt == 'c') {
+            cache_blocks = (size_t)strtoul(optarg, 0, 10);
+        } else if (opt == 'w') {
+            write_size = (size_t)strtoul(optarg, 0, 10);
+        } else if (opt == 'd') {
+            image = optarg;
+        } else if (opt == 's') {
+            if (storage_parse_kind(optarg, &kind) != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (op_count == 0 || write_size == 0 || cache_blocks < MIN_CACHE_BLOCKS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Image fits written data and all files with room for metadata
+    size_t size = (size_t)op_count * write_size * 5 / 4 + READ_FILE_SIZE;
+    size = (size < DEFAULT_IMAGE_SIZE) ? DEFAULT_IMAGE_SIZE : size;
+    struct storage disk;
+    int opened = (image != NULL) ? storage_open(&disk, image, kind, size)
+                                 : storage_open_memory(&disk, size);
+    if (opened != 0) {
+        perror("open image");
+        return 1;
+    }
+
+    // Data offset only decreases with block count, so the second count fits
+    struct superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic_number = MAGIC_NUMBER;
+    sb.block_size = block_size;
+    sb.inode_count = (uint32_t)op_count + 64;
+    sb.inode_size = sizeof(struct inode);
+    sb.block_count = (uint32_t)(size / block_size);
+    sb.journal_blocks = fs_min_journal_blocks(&sb);
+    sb.journal_blocks += (sb.block_count / 256 < 16) ? 16 : sb.block_count / 256;
+    struct fs_layout layout;
+    fs_compute_layout(&sb, &layout);
+    if (fs_check_geometry(&sb) != 0 || (size_t)layout.data_offset >= size) {
+        fprintf(stderr, "unsupported geometry\n");
+        return 1;
+    }
+    sb.block_count = (uint32_t)((size - (size_t)layout.data_offset) / block_size);
+    if (fs_format(&disk, block_size, sb.block_count, sb.inode_count, sb.journal_blocks,
+                  cache_blocks) != 0) {
+        fprintf(stderr, "cannot format image\n");
+        return 1;
+    }
+
+    // Reads of /proc/self/io are subtracted from measured counts
+    long long calls = syscall_count();
+    own_calls = syscall_count() - calls;
+
+    printf("%s image, %u-byte blocks, %zu cache blocks, %zu operations\n",
+           (image != NULL) ? image : "memory", block_size, cache_blocks, op_count);
+    printf("%-28s %12s %12s\n", "benchmark", "ns/op", "syscalls/op");
+
+    // Metadata is committed between benchmarks, so journal writes are not
+    // counted in the next one
+    char dir[] = "/m";
+    int result = create_at(dir, DIR, NULL);
+    int (*const benchmarks[])(void) = {bench_create, bench_find, bench_remove, bench_small,
+                                       bench_write,  bench_read, bench_alloc};
+    for (size_t i = 0; result == 0 && i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i) {
+        result = benchmarks[i]();
+        dump_info();
+    }
+
+    fs_shutdown();
+    storage_close(&disk);
+    return (result == 0) ? 0 : 1;
+}
@@ -1,6 +1,8 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,9 +10,31 @@
 #include <unistd.h>
 
 #include "common/net_utils.h"
+#include "common/protocol.h"
 #include "common/tokenizer.h"
 
+#define MAX_PIPELINE 64  // answers of unread requests must fit into socket buffers
+
 int conn_fd;
+int binary_mode;
+uint32_t last_request_id;
+
+// Requests sent without waiting for answers, server answers them in order
+struct pending_request {
+    uint32_t id;
+    int has_result;
+};
+struct pending_request pending[MAX_PIPELINE];
+size_t pending_head;
+size_t pending_count;
+size_t pipeline_depth = 1;
+
+// Operations collected between `batch` and `end` commands
+int in_batch;
+char* batch_ops;
+size_t batch_len;
+size_t batch_capacity;
+uint32_t batch_count;
 
 ssize_t get_user_line(char** line, size_t* maxlen) {
     printf(">>> ");
@@ -49,6 +73,9 @@ int connect_to_server(const char* ip, int port) {
         return -1;
     }
 
+    // Binary request is sent as header and arguments, they should not wait for each other
+    setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
     struct sockaddr_in serv_addr;
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_port = htons(port);
@@ -81,13 +108,179 @@ void send_tokens(struct tokenizer tokenizer) {
     safe_send(buffer, conn_fd, pos);
 }
 
+// Send command as text line or as binary request, return -1 if it is not sent
+int send_command(struct tokenizer tokenizer) {
+    if (!binary_mode) {
+        send_tokens(tokenizer);
+        return 0;
+    }
+
+    const char* args[PROTO_MAX_ARGS];
+    size_t arg_len[PROTO_MAX_ARGS];
+    size_t arg_count = tokenizer.token_count - 1;
+    if (arg_count > PROTO_MAX_ARGS) {
+        puts("too many arguments");
+        return -1;
+    }
+    struct token* token = tokenizer.head->next;
+    for (size_t i = 0; i < arg_count; ++i) {
+        args[i] = token->start;
+        arg_len[i] = token->len;
+        token = token->next;
+    }
+
+    enum opcode opcode = opcode_by_name(tokenizer.head->start, tokenizer.head->len);
+    if (send_request(conn_fd, opcode, ++last_request_id, args, arg_len, arg_count) != 0) {
+        puts("cannot send request, arguments are too long");
+        return -1;
+    }
+    return 0;
+}
+
+// Binary response starts with header, return -1 if it does not answer request_id
+int recv_header(uint32_t request_id) {
+    return binary_mode ? recv_response_header(conn_fd, request_id) : 0;
+}
+
+// Receive answer to the oldest pending request
+void recv_pending() {
+    struct pending_request request = pending[pending_head];
+    pending_head = (pending_head + 1) % MAX_PIPELINE;
+    --pending_count;
+    if (recv_header(request.id) == 0) {
+        recv_response(conn_fd, request.has_result);
+    }
+}
+
+void drain_pending() {
+    while (pending_count > 0) {
+        recv_pending();
+    }
+}
+
+// Send command with short answer, it is received once pipeline is full
+void pipeline_command(struct tokenizer tokenizer, int has_result) {
+    if (send_command(tokenizer) != 0) {
+        return;
+    }
+    pending[(pending_head + pending_count) % MAX_PIPELINE] =
+        (struct pending_request){.id = last_request_id, .has_result = has_result};
+    ++pending_count;
+    if (pending_count >= pipeline_depth) {
+        recv_pending();
+    }
+}
+
+// Append operation to batch, return -1 if it cannot be batched
+int add_batch_op(struct tokenizer tokenizer) {
+    enum opcode opcode = opcode_by_name(tokenizer.head->start, tokenizer.head->len);
+    if (opcode != OP_TOUCH && opcode != OP_MKDIR && opcode != OP_RM && opcode != OP_RMDIR) {
+        puts("only touch, mkdir, rm and rmdir are allowed in batch, finish it with `end`");
+        return -1;
+    }
+    if (tokenizer.token_count != 2 || tokenizer.head->next->len > PROTO_MAX_ARG_LEN) {
+        puts("Usage: <command> <path>");
+        return -1;
+    }
+    if (batch_count == PROTO_MAX_BATCH) {
+        puts("batch is full, finish it with `end`");
+        return -1;
+    }
+
+    struct token* path = tokenizer.head->next;
+    size_t op_len = sizeof(struct batch_op) + path->len;
+    if (batch_len + op_len > batch_capacity) {
+        size_t capacity = (batch_capacity == 0) ? 4096 : 2 * batch_capacity;
+        char* ops = realloc(batch_ops, capacity);
+        if (ops == NULL) {
+            puts("out of memory");
+            return -1;
+        }
+        batch_ops = ops;
+        batch_capacity = capacity;
+    }
+
+    struct batch_op op = {.opcode = (uint16_t)opcode, .len = (uint16_t)path->len};
+    memcpy(batch_ops + batch_len, &op, sizeof(op));
+    memcpy(batch_ops + batch_len + sizeof(op), path->start, path->len);
+    batch_len += op_len;
+    ++batch_count;
+    return 0;
+}
+
+// Batch is always sent as binary request, server accepts both kinds on one connection
+void send_batch() {
+    uint32_t request_id = ++last_request_id;
+    if (send_request(conn_fd, OP_BATCH, request_id, NULL, NULL, 0) == 0 &&
+        send_all((const char*)&batch_count, conn_fd, sizeof(batch_count)) == 0 &&
+        send_all(batch_ops, conn_fd, batch_len) == 0 &&
+        recv_response_header(conn_fd, request_id) == 0) {
+        recv_response(conn_fd, 0);
+    }
+    batch_len = 0;
+    batch_count = 0;
+}
+
+// Send content of local file in chunks, transfer is always finished
+// so that server can answer even after read error
+void send_file(FILE* file) {
+    char chunk[CHUNK_SIZE];
+    size_t len;
+    while ((len = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        if (send_chunk(chunk, conn_fd, (int)len) != 0) {
+            return;
+        }
+    }
+    if (ferror(file)) {
+        perror("read local file");
+    }
+    send_chunk_end(conn_fd);
+}
+
+// Receive file sent by server in chunks and write it to file
+int recv_file(FILE* file) {
+    int status = recv_status(conn_fd);
+    if (status != 1) {
+        char response[1024];
+        memset(response, 0, sizeof(response));
+        safe_recv(response, conn_fd);
+        fprintf(stderr, "%s\n", response);
+        return -1;
+    }
+
+    char chunk[CHUNK_SIZE];
+    int len;
+    while ((len = recv_chunk(chunk, conn_fd, sizeof(chunk))) > 0) {
+        fwrite(chunk, 1, (size_t)len, file);
+    }
+    return len;
+}
+
 int main(int argc, char** argv) {
     setbuf(stdout, NULL);
 
+    int opt;
+    while ((opt = getopt(argc, argv, "bp:")) != -1) {
+        if (opt == 'b') {
+            binary_mode = 1;
+        } else if (opt == 'p') {
+            // Answers are matched to requests by id, so binary requests are used
+            pipeline_depth = (size_t)strtoul(optarg, 0, 10);
+            binary_mode = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-b] [-p pipeline depth] [ip] [port]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (pipeline_depth == 0 || pipeline_depth > MAX_PIPELINE) {
+        fprintf(stderr, "Pipeline depth must be from 1 to %d\n", MAX_PIPELINE);
+        exit(1);
+    }
+
     printf("Welcome to MiniFS!\n");
 
-    const char* ip = "127.0.0.1";
-    const int port = 8080;
+    const char* ip = (optind < argc) ? argv[optind] : "127.0.0.1";
+    const int port = (optind + 1 < argc) ? (int)strtol(argv[optind + 1], 0, 10) : 8080;
 
     int user_id = read_user_id();
     if (connect_to_server(ip, port) < 0) {
@@ -121,16 +314,55 @@ int main(int argc, char** argv) {
         size_t len = tokenizer.head->len;
         char* first = tokenizer.head->start;
 
+        if (in_batch && strncmp(first, "quit", len) != 0) {
+            if (strncmp(first, "end", len) == 0) {
+                drain_pending();
+                send_batch();
+                in_batch = 0;
+            } else {
+                add_batch_op(tokenizer);
+            }
+            tokenizer_free(&tokenizer);
+            continue;
+        }
+
+        int pipelined = strncmp(first, "touch", len) == 0 || strncmp(first, "mkdir", len) == 0 ||
+                        strncmp(first, "rm", len) == 0 || strncmp(first, "rmdir", len) == 0 ||
+                        strncmp(first, "cd", len) == 0 || strncmp(first, "pwd", len) == 0 ||
+                        strncmp(first, "open", len) == 0 || strncmp(first, "close", len) == 0;
+        if (!pipelined) {
+            // Streamed answers are received right after their requests
+            drain_pending();
+        }
+
         if (strncmp(first, "quit", len) == 0) {
             tokenizer_free(&tokenizer);
             break;
         } else if (strncmp(first, "touch", len) == 0 || strncmp(first, "mkdir", len) == 0 ||
-                   strncmp(first, "rm", len) == 0 || strncmp(first, "rmdir", len) == 0) {
-            send_tokens(tokenizer);
-            recv_response(conn_fd, 0);
-        } else if (strncmp(first, "ls", len) == 0 || strncmp(first, "cat", len) == 0) {
-            send_tokens(tokenizer);
-            recv_response(conn_fd, 1);
+                   strncmp(first, "rm", len) == 0 || strncmp(first, "rmdir", len) == 0 ||
+                   strncmp(first, "cd", len) == 0 || strncmp(first, "close", len) == 0) {
+            pipeline_command(tokenizer, 0);
+        } else if (strncmp(first, "pwd", len) == 0 || strncmp(first, "open", len) == 0) {
+            pipeline_command(tokenizer, 1);
+        } else if (strncmp(first, "batch", len) == 0) {
+            in_batch = 1;
+        } else if (strncmp(first, "cat", len) == 0 || strncmp(first, "ls", len) == 0 ||
+                   strncmp(first, "stats", len) == 0) {
+            if (send_command(tokenizer) == 0 && recv_header(last_request_id) == 0 &&
+                recv_file(stdout) == 0) {
+                putchar('\n');
+            }
+        } else if (strncmp(first, "read", len) == 0) {
+            if (tokenizer.token_count != 3 && tokenizer.token_count != 4) {
+                puts("Usage: read <minifs path> <offset> <len>\n"
+                     "       read <handle> <len>");
+                tokenizer_free(&tokenizer);
+                continue;
+            }
+            if (send_command(tokenizer) == 0 && recv_header(last_request_id) == 0 &&
+                recv_file(stdout) == 0) {
+                putchar('\n');
+            }
         } else if (strncmp(first, "put", len) == 0) {
             if (tokenizer.token_count != 3) {
                 puts("Usage: put <minifs path> <global path>");
@@ -138,8 +370,6 @@ int main(int argc, char** argv) {
                 continue;
             }
 
-            send_tokens(tokenizer);
-
             struct token* third_token = tokenizer.head->next->next;
 
             char global_path[128];
@@ -149,19 +379,13 @@ int main(int argc, char** argv) {
             FILE* global = fopen(global_path, "w");
             if (global == NULL) {
                 puts("cannot create file at global path");
-                return -1;
-            }
-
-            // TODO: use heap to store file content
-            char content[4096];
-            memset(content, '\0', sizeof(content));
-            if (recv_store_response(conn_fd, content) < 0) {
-                fclose(global);
                 tokenizer_free(&tokenizer);
                 continue;
             }
 
-            fputs(content, global);
+            if (send_command(tokenizer) == 0 && recv_header(last_request_id) == 0) {
+                recv_file(global);
+            }
             fclose(global);
         } else if (strncmp(first, "get", len) == 0) {
             if (tokenizer.token_count != 3) {
@@ -170,8 +394,6 @@ int main(int argc, char** argv) {
                 continue;
             }
 
-            send_tokens(tokenizer);
-
             struct token* second_token = tokenizer.head->next;
 
             char global_path[128];
@@ -179,29 +401,64 @@ int main(int argc, char** argv) {
             strncpy(global_path, second_token->start, second_token->len);
 
             FILE* global = fopen(global_path, "r");
+            if (global == NULL) {
+                puts("cannot open file at global path");
+                tokenizer_free(&tokenizer);
+                continue;
+            }
 
-            struct stat stat_info;
-            fstat(fileno(global), &stat_info);
+            if (send_command(tokenizer) == 0) {
+                send_file(global);
+                if (recv_header(last_request_id) == 0) {
+                    recv_response(conn_fd, 0);
+                }
+            }
+            fclose(global);
+        } else if (strncmp(first, "write", len) == 0) {
+            if (tokenizer.token_count != 3 && tokenizer.token_count != 4) {
+                puts("Usage: write <minifs path> <offset> <global path>\n"
+                     "       write <handle> <global path>");
+                tokenizer_free(&tokenizer);
+                continue;
+            }
 
-            char* content = malloc(stat_info.st_size + 1);
-            fseek(global, 0, SEEK_SET);
-            fread(content, 1, stat_info.st_size, global);
-            content[stat_info.st_size] = '\0';
-            assert(strlen(content) == stat_info.st_size);
+            // Source file is the last argument in both forms
+            struct token* last_token = tokenizer.head;
+            while (last_token->next != NULL) {
+                last_token = last_token->next;
+            }
 
-            safe_send(content, conn_fd, -1);
+            char global_path[128];
+            memset(global_path, 0, sizeof(global_path));
+            strncpy(global_path, last_token->start, last_token->len);
 
+            FILE* global = fopen(global_path, "r");
+            if (global == NULL) {
+                puts("cannot open file at global path");
+                tokenizer_free(&tokenizer);
+                continue;
+            }
+
+            if (send_command(tokenizer) == 0) {
+                send_file(global);
+                if (recv_header(last_request_id) == 0) {
+                    recv_response(conn_fd, 0);
+                }
+            }
             fclose(global);
-            recv_response(conn_fd, 0);
         } else {
             printf("Unexpected input, please retry\n");
             printf("Supported commands:\n");
-            printf("touch, mkdir, cat, ls, rm, rmdir, put, get\n");
+            printf("touch, mkdir, cat, ls, rm, rmdir, put, get, read, write, open, close,\n"
+                   "cd, pwd, stats, batch ... end\n");
         }
 
         tokenizer_free(&tokenizer);
     }
 
+    // Unfinished batch is discarded
+    drain_pending();
+    free(batch_ops);
     close(conn_fd);
     return 0;
 }
@@ -108,4 +108,62 @@ int recv_store_response(int conn_fd, char* buf) {
         fprintf(stderr, "%s\n", response);
         return -1;
     }
-}
\ No newline at end of file
+}
+
+int send_all(const char* buf, int conn_fd, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        ssize_t send_bytes = send(conn_fd, buf + pos, len - pos, 0);
+        if (send_bytes < 0) {
+            perror("send all");
+            return -1;
+        }
+        pos += send_bytes;
+    }
+    return 0;
+}
+
+int recv_all(char* buf, int conn_fd, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        ssize_t recv_bytes = recv(conn_fd, buf + pos, len - pos, 0);
+        if (recv_bytes <= 0) {
+            if (recv_bytes < 0) {
+                perror("recv all");
+            }
+            return -1;
+        }
+        pos += recv_bytes;
+    }
+    return 0;
+}
+
+int send_chunk(const char* buf, int conn_fd, int len) {
+    if (len <= 0) {
+        return 0;  // empty chunk would end the transfer
+    }
+    if (send_all((const char*)&len, conn_fd, sizeof(int)) != 0) {
+        return -1;
+    }
+    return send_all(buf, conn_fd, (size_t)len);
+}
+
+int send_chunk_end(int conn_fd) {
+    int len = 0;
+    return send_all((const char*)&len, conn_fd, sizeof(int));
+}
+
+int recv_chunk(char* buf, int conn_fd, int max_len) {
+    int len = 0;
+    if (recv_all((char*)&len, conn_fd, sizeof(int)) != 0) {
+        return -1;
+    }
+    if (len < 0 || len > max_len) {
+        fprintf(stderr, "recv chunk: bad chunk length %d\n", len);
+        return -1;
+    }
+    if (len > 0 && recv_all(buf, conn_fd, (size_t)len) != 0) {
+        return -1;
+    }
+    return len;
+}
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common/net_utils.h"
+#include "common/protocol.h"
+
+static const char* const opcode_names[OP_COUNT] = {
+    [OP_QUIT] = "quit", [OP_TOUCH] = "touch", [OP_MKDIR] = "mkdir",
+    [OP_RM] = "rm",     [OP_RMDIR] = "rmdir", [OP_CAT] = "cat",
+    [OP_LS] = "ls",     [OP_PUT] = "put",     [OP_GET] = "get",
+    [OP_BATCH] = "batch", [OP_READ] = "read",   [OP_WRITE] = "write",
+    [OP_CD] = "cd",       [OP_PWD] = "pwd",     [OP_OPEN] = "open",
+    [OP_CLOSE] = "close", [OP_STATS] = "stats",
+};
+
+const char* opcode_name(enum opcode opcode) {
+    return (opcode < OP_COUNT) ? opcode_names[opcode] : NULL;
+}
+
+enum opcode opcode_by_name(const char* name, size_t len) {
+    for (int op = OP_INVALID + 1; op < OP_COUNT; ++op) {
+        if (strlen(opcode_names[op]) == len && strncmp(opcode_names[op], name, len) == 0) {
+            return (enum opcode)op;
+        }
+    }
+    return OP_INVALID;
+}
+
+int send_request(int conn_fd, enum opcode opcode, uint32_t request_id, const char* const* args,
+                 const size_t* arg_len, size_t arg_count) {
+    struct request_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTO_MAGIC;
+    header.opcode = (uint16_t)opcode;
+    header.arg_count = (uint16_t)arg_count;
+    header.request_id = request_id;
+
+    if (arg_count > PROTO_MAX_ARGS) {
+        return -1;
+    }
+    for (size_t i = 0; i < arg_count; ++i) {
+        if (arg_len[i] > PROTO_MAX_ARG_LEN) {
+            return -1;
+        }
+        header.arg_len[i] = (uint16_t)arg_len[i];
+    }
+
+    if (send_all((const char*)&header, conn_fd, sizeof(header)) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < arg_count; ++i) {
+        if (send_all(args[i], conn_fd, arg_len[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Arguments are received one after another into data, each followed by '\0'
+static int recv_binary(int conn_fd, struct request* request) {
+    struct request_header header;
+    size_t magic_len = sizeof(header.magic);
+    if (recv_all((char*)&header + magic_len, conn_fd, sizeof(header) - magic_len) != 0) {
+        return -1;
+    }
+    if (header.arg_count > PROTO_MAX_ARGS) {
+        fprintf(stderr, "recv request: too many arguments %u\n", header.arg_count);
+        return -1;
+    }
+
+    request->binary = 1;
+    request->opcode = (header.opcode < OP_COUNT) ? (enum opcode)header.opcode : OP_INVALID;
+    request->id = header.request_id;
+    request->arg_count = header.arg_count;
+
+    char* pos = request->data;
+    for (size_t i = 0; i < request->arg_count; ++i) {
+        size_t len = header.arg_len[i];
+        if (len > PROTO_MAX_ARG_LEN) {
+            fprintf(stderr, "recv request: too long argument %zu\n", len);
+            return -1;
+        }
+        if (recv_all(pos, conn_fd, len) != 0) {
+            return -1;
+        }
+        pos[len] = '\0';
+        request->args[i] = pos;
+        request->arg_len[i] = len;
+        pos += len + 1;
+    }
+    return 0;
+}
+
+// Split line in place, first token is the command name
+static int parse_line(struct request* request) {
+    request->binary = 0;
+    request->opcode = OP_INVALID;
+    request->id = 0;
+    request->arg_count = 0;
+
+    char* next = request->data;
+    int has_command = 0;
+    while (1) {
+        next += strspn(next, " \t\n");
+        if (*next == '\0') {
+            break;
+        }
+
+        char* start = next;
+        next += strcspn(next, " \t\n");
+        size_t len = next - start;
+        if (*next != '\0') {
+            *next++ = '\0';
+        }
+
+        if (!has_command) {
+            request->opcode = opcode_by_name(start, len);
+            has_command = 1;
+        } else {
+            if (request->arg_count < PROTO_MAX_ARGS) {
+                request->args[request->arg_count] = start;
+                request->arg_len[request->arg_count] = len;
+            }
+            ++request->arg_count;
+        }
+    }
+    return has_command ? 0 : -1;
+}
+
+int recv_request(int conn_fd, struct request* request) {
+    uint32_t prefix;
+    if (recv_all((char*)&prefix, conn_fd, sizeof(prefix)) != 0) {
+        return -1;
+    }
+    if (prefix == PROTO_MAGIC) {
+        return recv_binary(conn_fd, request);
+    }
+
+    // Length of text line
+    if (prefix == 0 || prefix > PROTO_LINE_LEN) {
+        return -1;
+    }
+    if (recv_all(request->data, conn_fd, prefix) != 0) {
+        return -1;
+    }
+    request->data[prefix] = '\0';
+    return parse_line(request);
+}
+
+int recv_batch_op(int conn_fd, struct request* op) {
+    struct batch_op header;
+    if (recv_all((char*)&header, conn_fd, sizeof(header)) != 0) {
+        return -1;
+    }
+    if (header.len > PROTO_MAX_ARG_LEN) {
+        fprintf(stderr, "recv batch: too long path %u\n", header.len);
+        return -1;
+    }
+    if (recv_all(op->data, conn_fd, header.len) != 0) {
+        return -1;
+    }
+    op->data[header.len] = '\0';
+
+    op->binary = 1;
+    op->opcode = (header.opcode < OP_COUNT) ? (enum opcode)header.opcode : OP_INVALID;
+    op->arg_count = 1;
+    op->args[0] = op->data;
+    op->arg_len[0] = header.len;
+    return 0;
+}
+
+int send_response_header(int conn_fd, const struct request* request) {
+    if (!request->binary) {
+        return 0;
+    }
+    struct response_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = PROTO_MAGIC;
+    header.opcode = (uint16_t)request->opcode;
+    header.request_id = request->id;
+    return send_all((const char*)&header, conn_fd, sizeof(header));
+}
+
+int recv_response_header(int conn_fd, uint32_t request_id) {
+    struct response_header header;
+    if (recv_all((char*)&header, conn_fd, sizeof(header)) != 0) {
+        return -1;
+    }
+    if (header.magic != PROTO_MAGIC || header.request_id != request_id) {
+        fprintf(stderr, "recv response: unexpected response to request %u\n", header.request_id);
+        return -1;
+    }
+    return 0;
+}
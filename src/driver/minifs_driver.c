@@ -4,12 +4,19 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/syscalls.h>
 #include <linux/uaccess.h>
 
 #define MINIFS_BLOCK_SIZE 1024
-#define DISK_SIZE 73632
+#define MINIFS_CHUNK_SIZE 4096  // bounce buffer, kernel stack is too small for requests
+
+// Default size matches geometry used by server for unformatted disk,
+// bigger disks are formatted by mkfs.minifs
+static unsigned long disk_size = 73632;
+module_param(disk_size, ulong, 0444);
+MODULE_PARM_DESC(disk_size, "Size of minifs disk in bytes");
 
 static int minifs_open(struct inode*, struct file*);
 static ssize_t minifs_read(struct file*, char __user*, size_t, loff_t*);
@@ -60,10 +67,16 @@ static int minifs_open(struct inode* inode, struct file* file) {
         buf[i] = 0;
     }
 
+    // Keep existing content so that filesystem survives reopening,
+    // only zero-fill the part of backing file that does not exist yet
     filp = filp_open(disk_path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-    for (i = 0; i * MINIFS_BLOCK_SIZE < DISK_SIZE; ++i) {
-        offset = i * MINIFS_BLOCK_SIZE;
-        kernel_write(filp, buf, MINIFS_BLOCK_SIZE, &offset);
+    if (IS_ERR(filp)) {
+        return PTR_ERR(filp);
+    }
+    offset = i_size_read(file_inode(filp));
+    for (; offset < disk_size; offset += MINIFS_BLOCK_SIZE) {
+        loff_t position = offset;
+        kernel_write(filp, buf, MINIFS_BLOCK_SIZE, &position);
     }
     filp_close(filp, NULL);
 
@@ -71,45 +84,109 @@ static int minifs_open(struct inode* inode, struct file* file) {
 }
 
 static ssize_t minifs_read(struct file* file, char __user* user, size_t count, loff_t* offset) {
-    int bytes_read;
     struct file* filp;
-    char buf[count];
-    loff_t old_offset = *offset;
-    
-    if (*offset + count > DISK_SIZE) {
-        count = DISK_SIZE - *offset;
+    char* buf;
+    size_t done = 0;
+    ssize_t result = 0;
+
+    if (*offset < 0) {
+        return -EINVAL;
+    }
+    if (*offset >= disk_size) {
+        return 0;
+    }
+    if (count > disk_size - *offset) {
+        count = disk_size - *offset;
+    }
+
+    buf = kmalloc(MINIFS_CHUNK_SIZE, GFP_KERNEL);
+    if (buf == NULL) {
+        return -ENOMEM;
     }
     filp = filp_open(disk_path, O_RDONLY, 0);
-    bytes_read = kernel_read(filp, buf, count, offset);
-    if (copy_to_user(user, buf, bytes_read)) {
-        filp_close(filp, NULL);
-        return -EFAULT;
+    if (IS_ERR(filp)) {
+        kfree(buf);
+        return PTR_ERR(filp);
+    }
+    while (done < count) {
+        size_t part = min_t(size_t, count - done, MINIFS_CHUNK_SIZE);
+        loff_t position = *offset + done;
+        ssize_t bytes_read = kernel_read(filp, buf, part, &position);
+        if (bytes_read <= 0) {
+            result = bytes_read;
+            break;
+        }
+        if (copy_to_user(user + done, buf, bytes_read)) {
+            result = -EFAULT;
+            break;
+        }
+        done += bytes_read;
+        if ((size_t)bytes_read < part) {
+            break;
+        }
     }
     filp_close(filp, NULL);
+    kfree(buf);
 
-    *offset = old_offset + bytes_read;
-    return bytes_read;
+    if (done == 0) {
+        return result;
+    }
+    *offset += done;
+    return done;
 }
 
 static ssize_t minifs_write(struct file* file, const char __user* user, size_t count,
                             loff_t* offset) {
-    int bytes_written;
     struct file* filp;
-    char buf[count];
-    loff_t old_offset = *offset;
-    
-    if (*offset + count > DISK_SIZE) {
-        count = DISK_SIZE - *offset;
+    char* buf;
+    size_t done = 0;
+    ssize_t result = 0;
+
+    if (*offset < 0) {
+        return -EINVAL;
     }
-    if (copy_from_user(buf, user, count)) {
-        return -EFAULT;
+    if (*offset >= disk_size) {
+        return (count == 0) ? 0 : -ENOSPC;
+    }
+    if (count > disk_size - *offset) {
+        count = disk_size - *offset;
+    }
+
+    buf = kmalloc(MINIFS_CHUNK_SIZE, GFP_KERNEL);
+    if (buf == NULL) {
+        return -ENOMEM;
     }
     filp = filp_open(disk_path, O_WRONLY, 0);
-    bytes_written = kernel_write(filp, buf, count, offset);
+    if (IS_ERR(filp)) {
+        kfree(buf);
+        return PTR_ERR(filp);
+    }
+    while (done < count) {
+        size_t part = min_t(size_t, count - done, MINIFS_CHUNK_SIZE);
+        loff_t position = *offset + done;
+        ssize_t bytes_written;
+        if (copy_from_user(buf, user + done, part)) {
+            result = -EFAULT;
+            break;
+        }
+        bytes_written = kernel_write(filp, buf, part, &position);
+        if (bytes_written <= 0) {
+            result = bytes_written;
+            break;
+        }
+        done += bytes_written;
+        if ((size_t)bytes_written < part) {
+            break;
+        }
+    }
     filp_close(filp, NULL);
+    kfree(buf);
 
-    *offset = old_offset + bytes_written;
-    return bytes_written;
+    if (done == 0) {
+        return result;
+    }
+    *offset += done;
+    return done;
 }
 
 static loff_t minifs_llseek(struct file* filp, loff_t off, int whence) {
@@ -122,7 +199,7 @@ static loff_t minifs_llseek(struct file* filp, loff_t off, int whence) {
             newpos = filp->f_pos + off;
             break;
         case 2: /* SEEK_END */
-            newpos = DISK_SIZE + off;
+            newpos = disk_size + off;
             break;
         default: /* can't happen */
             return -EINVAL;
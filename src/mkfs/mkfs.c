@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server/cache.h"
+#include "server/fs.h"
+
+#define DEFAULT_INODE_RATIO 16384
+#define JOURNAL_RATIO 256
+#define MIN_JOURNAL_BLOCKS 16
+#define MAX_JOURNAL_BLOCKS 16384
+
+// Filesystem code reports errors to the current client
+_Thread_local int client_fd = -1;
+
+void print_usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [-b block size = %d] [-i bytes per inode = %d] [-N inode count] "
+            "[-J journal blocks] <image> [size]\n"
+            "Size accepts K, M and G suffixes, by default the whole image is used.\n"
+            "Journal fits all metadata plus 1/%d of blocks (at least %d) by default,\n"
+            "0 disables it\n",
+            name, DEFAULT_BLOCK_SIZE, DEFAULT_INODE_RATIO, JOURNAL_RATIO, MIN_JOURNAL_BLOCKS);
+}
+
+// Parse number with optional binary suffix, return 0 on error
+unsigned long long parse_size(const char* str) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (errno != 0 || end == str) {
+        return 0;
+    }
+
+    switch (*end) {
+        case '\0':
+            return size;
+        case 'k':
+        case 'K':
+            size <<= 10;
+            break;
+        case 'm':
+        case 'M':
+            size <<= 20;
+            break;
+        case 'g':
+        case 'G':
+            size <<= 30;
+            break;
+        default:
+            return 0;
+    }
+    return (end[1] == '\0') ? size : 0;
+}
+
+// Find the biggest block count whose metadata and data fit into disk_size
+uint32_t fit_block_count(uint32_t block_size, uint32_t inode_count, uint32_t journal_blocks,
+                         off_t disk_size) {
+    struct superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.block_size = block_size;
+    sb.inode_count = inode_count;
+    sb.inode_size = sizeof(struct inode);
+    sb.journal_blocks = journal_blocks;
+
+    struct fs_layout layout;
+    off_t block_count = disk_size / block_size;
+    // Data offset only decreases when block count does, so two passes are enough
+    for (int pass = 0; pass < 2; ++pass) {
+        sb.block_count = (uint32_t)block_count;
+        fs_compute_layout(&sb, &layout);
+        block_count = (disk_size - layout.data_offset) / block_size;
+        if (block_count <= 0) {
+            return 0;
+        }
+    }
+    return (block_count > INT32_MAX) ? INT32_MAX : (uint32_t)block_count;
+}
+
+int main(int argc, char** argv) {
+    unsigned long long block_size = DEFAULT_BLOCK_SIZE;
+    unsigned long long inode_ratio = DEFAULT_INODE_RATIO;
+    unsigned long long inode_count = 0;
+    long long journal_blocks = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:i:N:J:")) != -1) {
+        switch (opt) {
+            case 'b':
+                block_size = parse_size(optarg);
+                break;
+            case 'i':
+                inode_ratio = parse_size(optarg);
+                break;
+            case 'N':
+                inode_count = parse_size(optarg);
+                break;
+            case 'J':
+                journal_blocks = strtoll(optarg, NULL, 10);
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || block_size == 0 || inode_ratio == 0 || journal_blocks < -1 ||
+        journal_blocks > MAX_JOURNAL_BLOCKS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char* path = argv[optind];
+
+    unsigned long long disk_size = 0;
+    if (optind + 1 < argc && (disk_size = parse_size(argv[optind + 1])) == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct storage disk;
+    if (storage_open(&disk, path, STORAGE_PIO, disk_size ? disk_size : DEFAULT_DISK_SIZE) != 0) {
+        perror("cannot open image");
+        return 1;
+    }
+    if (disk_size == 0) {
+        disk_size = disk.size;
+    }
+
+    if (inode_count == 0) {
+        inode_count = disk_size / inode_ratio;
+        if (inode_count < DEFAULT_INODE_COUNT) {
+            inode_count = DEFAULT_INODE_COUNT;
+        }
+    }
+    if (inode_count > INT32_MAX) {
+        inode_count = INT32_MAX;
+    }
+
+    // Journal never splits transaction, so it fits the whole metadata region
+    struct superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.block_size = (uint32_t)block_size;
+    sb.inode_count = (uint32_t)inode_count;
+    sb.inode_size = sizeof(struct inode);
+    sb.block_count = (uint32_t)(disk_size / block_size);
+    uint32_t min_journal = (block_size <= MAX_BLOCK_SIZE) ? fs_min_journal_blocks(&sb) : 0;
+    if (journal_blocks == -1) {
+        journal_blocks = disk_size / block_size / JOURNAL_RATIO;
+        if (journal_blocks < MIN_JOURNAL_BLOCKS) {
+            journal_blocks = MIN_JOURNAL_BLOCKS;
+        }
+        if (journal_blocks > MAX_JOURNAL_BLOCKS) {
+            journal_blocks = MAX_JOURNAL_BLOCKS;
+        }
+        journal_blocks += min_journal;
+    } else if (journal_blocks > 0 && journal_blocks < min_journal) {
+        fprintf(stderr, "journal needs at least %u blocks\n", min_journal);
+        storage_close(&disk);
+        return 1;
+    }
+
+    uint32_t block_count = 0;
+    if (block_size <= MAX_BLOCK_SIZE) {
+        block_count = fit_block_count((uint32_t)block_size, (uint32_t)inode_count,
+                                      (uint32_t)journal_blocks, disk_size);
+    }
+    if (block_count == 0 || fs_format(&disk, (uint32_t)block_size, block_count,
+                                      (uint32_t)inode_count, (uint32_t)journal_blocks,
+                                      DEFAULT_CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "cannot create filesystem with block size %llu and %llu inodes "
+                "on %llu bytes\n", block_size, inode_count, disk_size);
+        storage_close(&disk);
+        return 1;
+    }
+    fs_shutdown();
+    storage_close(&disk);
+
+    printf("%s: %u blocks of %llu bytes, %llu inodes, %lld journal blocks\n", path, block_count,
+           block_size, inode_count, journal_blocks);
+    return 0;
+}
@@ -1,25 +1,191 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "server/adapter.h"
+#include "server/cache.h"
+#include "server/journal.h"
+#include "server/stats.h"
 
-int perform_init(int disk_fd, int client_fd) {
-    return fs_init(disk_fd, client_fd);
+#define READAHEAD_MAX (1 << 20)  // longest range prefetched for next read through handle
+
+static const char zero_chunk[CHUNK_SIZE];
+
+// Open files of session served by this thread
+static _Thread_local struct handle_table* handles;
+
+// Stream len bytes of file from offset in chunks. Blocks of the next
+// chunk are prefetched before the current one is sent, so disk reads overlap
+// with socket sends. Every chunk is read under lock separately, so lock is not
+// held while waiting for the client; transfer stops early if file is removed meanwhile
+static int send_buffered(struct fs_file* file, uint64_t offset, uint64_t len, int client_fd) {
+    char* chunk = malloc(CHUNK_SIZE);
+    if (chunk == NULL) {
+        send_failure("send_file: out of memory", client_fd);
+        return -1;
+    }
+
+    send_status(1, client_fd);
+
+    size_t part = (len < CHUNK_SIZE) ? (size_t)len : CHUNK_SIZE;
+    prefetch_range(&file->ref, offset, part);
+    while (len > 0) {
+        ssize_t got = read_at(file, offset, chunk, part);
+        if (got <= 0) {
+            break;
+        }
+        offset += got;
+        len -= got;
+        part = (len < CHUNK_SIZE) ? (size_t)len : CHUNK_SIZE;
+        prefetch_range(&file->ref, offset, part);
+        if (send_chunk(chunk, client_fd, (int)got) != 0) {
+            free(chunk);
+            return -1;
+        }
+    }
+    free(chunk);
+    return send_chunk_end(client_fd);
 }
 
-int perform_touch(struct tokenizer tokenizer, int client_fd) {
-    if (tokenizer.token_count != 2) {
-        send_failure("Usage: touch <path>", client_fd);
+// Send content of one chunk from image, socket is non-blocking here. Return number
+// of bytes sent, which is less than len if file is cut or removed meanwhile
+static ssize_t send_direct_chunk(struct fs_file* file, uint64_t offset, size_t len,
+                                 int client_fd) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t sent = sendfile_at(file, offset + done, len - done, client_fd);
+        if (sent > 0) {
+            done += sent;
+            continue;
+        }
+        if (sent < 0 && errno == EAGAIN) {
+            struct pollfd pollfd = {.fd = client_fd, .events = POLLOUT};
+            if (poll(&pollfd, 1, -1) < 0 && errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+        if (sent < 0 && errno != ENOENT) {
+            return -1;
+        }
+        break;
+    }
+    return (ssize_t)done;
+}
+
+// Zero-copy variant of send_buffered for image files. Length of chunk is sent
+// before its content, so content cut by concurrent truncate is padded with zeros
+static int send_direct(struct fs_file* file, uint64_t offset, uint64_t len, int client_fd) {
+    send_status(1, client_fd);
+
+    int flags = fcntl(client_fd, F_GETFL, 0);
+    while (len > 0) {
+        int part = (len < CHUNK_SIZE) ? (int)len : CHUNK_SIZE;
+        if (send_all((const char*)&part, client_fd, sizeof(int)) != 0) {
+            return -1;
+        }
+
+        // Lock is held during sendfile, so it must not wait for the client
+        fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
+        ssize_t sent = send_direct_chunk(file, offset, (size_t)part, client_fd);
+        fcntl(client_fd, F_SETFL, flags);
+
+        if (sent < 0) {
+            return -1;
+        }
+        if (sent < part) {
+            send_all(zero_chunk, client_fd, (size_t)(part - sent));
+            break;
+        }
+        offset += part;
+        len -= part;
+    }
+    return send_chunk_end(client_fd);
+}
+
+// Send part of file as it was at lookup, range past its end is cut
+static int send_range(struct fs_file* file, const struct inode* stat, uint64_t offset,
+                      uint64_t len, int client_fd) {
+    if (offset >= stat->file_len) {
+        len = 0;
+    } else if (len > stat->file_len - offset) {
+        len = stat->file_len - offset;
+    }
+    if (fs_zero_copy()) {
+        return send_direct(file, offset, len, client_fd);
+    }
+    return send_buffered(file, offset, len, client_fd);
+}
+
+static int send_file(struct fs_file* file, const struct inode* stat, int client_fd) {
+    return send_range(file, stat, 0, stat->file_len, client_fd);
+}
+
+// Parse decimal argument, the whole string must be a number
+static int parse_u64(const char* str, uint64_t* value) {
+    if (*str < '0' || *str > '9') {
+        return -1;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long result = strtoull(str, &end, 10);
+    if (errno != 0 || *end != '\0') {
         return -1;
     }
+    *value = (uint64_t)result;
+    return 0;
+}
 
-    struct token* second_token = tokenizer.head->next;
+// Resolve path of regular file for ranged access, error is sent to client
+static int open_regular(const char* arg, const char* who, struct fs_file* file,
+                        struct inode* stat, int client_fd) {
+    char path[128];
+    memset(path, 0, sizeof(path));
+    strncpy(path, arg, sizeof(path) - 1);
+
+    struct inode inode;
+    char response[128];
+    if (open_file(path, file, &inode) != 0) {
+        snprintf(response, sizeof(response), "%s: file not found", who);
+        send_failure(response, client_fd);
+        return -1;
+    }
+    if (inode.type != REG) {
+        snprintf(response, sizeof(response), "%s: not a regular file", who);
+        send_failure(response, client_fd);
+        return -1;
+    }
+    if (stat != NULL) {
+        *stat = inode;
+    }
+    return 0;
+}
+
+int perform_init(struct storage* disk, int client_fd, size_t cache_blocks, int format) {
+    return fs_init(disk, client_fd, cache_blocks, format);
+}
+
+int perform_shutdown() {
+    return fs_shutdown();
+}
+
+int perform_touch(const struct request* request, int client_fd) {
+    if (request->arg_count != 1) {
+        send_failure("Usage: touch <path>", client_fd);
+        return -1;
+    }
 
     char path[128];
     memset(path, 0, sizeof(path));
-    strncpy(path, second_token->start, second_token->len);
+    strncpy(path, request->args[0], sizeof(path) - 1);
 
     if (create_at(path, REG, NULL) != 0) {
         return -1;
@@ -29,17 +195,15 @@ int perform_touch(struct tokenizer tokenizer, int client_fd) {
     return 0;
 }
 
-int perform_mkdir(struct tokenizer tokenizer, int client_fd) {
-    if (tokenizer.token_count != 2) {
+int perform_mkdir(const struct request* request, int client_fd) {
+    if (request->arg_count != 1) {
         send_failure("Usage: mkdir <path>", client_fd);
         return -1;
     }
 
-    struct token* second_token = tokenizer.head->next;
-
     char path[128];
     memset(path, 0, sizeof(path));
-    strncpy(path, second_token->start, second_token->len);
+    strncpy(path, request->args[0], sizeof(path) - 1);
 
     if (create_at(path, DIR, NULL) != 0) {
         return -1;
@@ -49,17 +213,15 @@ int perform_mkdir(struct tokenizer tokenizer, int client_fd) {
     return 0;
 }
 
-int perform_rm(struct tokenizer tokenizer, int client_fd) {
-    if (tokenizer.token_count != 2) {
+int perform_rm(const struct request* request, int client_fd) {
+    if (request->arg_count != 1) {
         send_failure("Usage: rm <file path>", client_fd);
         return -1;
     }
 
-    struct token* second_token = tokenizer.head->next;
-
     char path[128];
     memset(path, 0, sizeof(path));
-    strncpy(path, second_token->start, second_token->len);
+    strncpy(path, request->args[0], sizeof(path) - 1);
 
     if (remove_at(path) != 0) {
         return -1;
@@ -70,17 +232,15 @@ int perform_rm(struct tokenizer tokenizer, int client_fd) {
 }
 
 // TODO: distinguish regular files and folders for `rm` and `rmdir`
-int perform_rmdir(struct tokenizer tokenizer, int client_fd) {
-    if (tokenizer.token_count != 2) {
+int perform_rmdir(const struct request* request, int client_fd) {
+    if (request->arg_count != 1) {
         send_failure("Usage: rmdir <dir path>", client_fd);
         return -1;
     }
 
-    struct token* second_token = tokenizer.head->next;
-
     char path[128];
     memset(path, 0, sizeof(path));
-    strncpy(path, second_token->start, second_token->len);
+    strncpy(path, request->args[0], sizeof(path) - 1);
 
     if (remove_at(path) != 0) {
         return -1;
@@ -89,133 +249,500 @@ int perform_rmdir(struct tokenizer tokenizer, int client_fd) {
     return 0;
 }
 
-int perform_cat(struct tokenizer tokenizer, int client_fd) {
-    if (tokenizer.token_count != 2) {
+int perform_cat(const struct request* request, int client_fd) {
+    if (request->arg_count != 1) {
         send_failure("Usage: cat <file path>", client_fd);
         return -1;
     }
 
-    struct token* second_token = tokenizer.head->next;
-
     char path[128];
     memset(path, 0, sizeof(path));
-    strncpy(path, second_token->start, second_token->len);
+    strncpy(path, request->args[0], sizeof(path) - 1);
 
-    ssize_t res;
-    if ((res = find_file(path)) == -1) {
+    struct fs_file file;
+    struct inode inode;
+    if (open_file(path, &file, &inode) != 0) {
         send_failure("perform_cat: file not found", client_fd);
         return -1;
     }
-    int inode_index = (int)res;
-    struct inode* inode = get_inode(inode_index);
 
-    if (inode->type != REG) {
+    if (inode.type != REG) {
         send_failure("perform_cat: not a regular file", client_fd);
         return -1;
     }
 
-    char* content = read_file(inode_index);
-    
-    // Send response to client
-    send_success(content, client_fd);
-    
-    free(content);
-    return 0;
+    return send_file(&file, &inode, client_fd);
 }
 
-int perform_ls(struct tokenizer tokenizer, int client_fd) {
-    if (tokenizer.token_count != 2) {
-        send_failure("Usage: ls <dir path>", client_fd);
+int perform_ls(const struct request* request, int client_fd) {
+    if (request->arg_count > 1) {
+        send_failure("Usage: ls [dir path]", client_fd);
         return -1;
     }
 
-    struct token* second_token = tokenizer.head->next;
-
+    // Without argument working directory is listed
     char path[128];
     memset(path, 0, sizeof(path));
-    strncpy(path, second_token->start, second_token->len);
+    strncpy(path, (request->arg_count == 1) ? request->args[0] : ".", sizeof(path) - 1);
 
-    ssize_t res;
-    if ((res = find_file(path)) == -1) {
+    struct inode_ref ref;
+    struct inode inode;
+    if (lookup_file(path, &ref, &inode) != 0) {
         send_failure("perform_ls: directory not found", client_fd);
         return -1;
     }
-    int inode_index = (int)res;
-    struct inode* inode = get_inode(inode_index);
 
-    if (inode->type != DIR) {
+    if (inode.type != DIR) {
         send_failure("perform_ls: not a directory", client_fd);
         return -1;
     }
 
-    int dir_count = (int)(inode->file_len / sizeof(struct dir_entry));
-    struct dir_entry* dirs = (struct dir_entry*)read_file(inode_index);
-    
-    char response[1024];
-    memset(response, 0, sizeof(response));
+    uint64_t dir_len;
+    struct dir_entry* dirs = (struct dir_entry*)read_file(&ref, &dir_len);
+    if (dirs == NULL) {
+        send_failure("perform_ls: directory not found", client_fd);
+        return -1;
+    }
+    int dir_count = (int)(dir_len / sizeof(struct dir_entry));
+
+    char* text = malloc(CHUNK_SIZE);
+    if (text == NULL) {
+        free(dirs);
+        send_failure("perform_ls: out of memory", client_fd);
+        return -1;
+    }
+
+    // Names are separated by newlines and streamed in chunks, so listing
+    // of any directory fits
+    send_status(1, client_fd);
     int pos = 0;
     for (int i = 0; i < dir_count; ++i) {
-        if (i > 0) {
-            response[pos++] = '\n';
+        if (pos + NAME_LEN + 1 > CHUNK_SIZE) {
+            if (send_chunk(text, client_fd, pos) != 0) {
+                free(text);
+                free(dirs);
+                return -1;
+            }
+            pos = 0;
         }
-        sprintf(&response[pos],"%s", dirs[i].name);
-        pos += (int)strlen(dirs[i].name);
+        pos += snprintf(text + pos, CHUNK_SIZE - pos, "%s%.*s", (i > 0) ? "\n" : "",
+                        NAME_LEN - 1, dirs[i].name);
     }
-    
-    // Send response to client
-    send_success(response, client_fd);
-
+    int result = (pos == 0 || send_chunk(text, client_fd, pos) == 0) ? send_chunk_end(client_fd)
+                                                                      : -1;
+    free(text);
     free(dirs);
-    return 0;
+    return result;
 }
 
-int perform_get(struct tokenizer tokenizer, int client_fd) {
-    // Tokens correctness is checked by client
-    struct token* third_token = tokenizer.head->next->next;
+int perform_get(const struct request* request, int client_fd) {
+    // Client sends content only for well-formed command
+    if (request->arg_count != 2) {
+        send_failure("Usage: get <global path> <minifs path>", client_fd);
+        return -1;
+    }
 
     char minifs_path[128];
     memset(minifs_path, 0, sizeof(minifs_path));
-    strncpy(minifs_path, third_token->start, third_token->len);
-    
-    // TODO: use heap to store file content
-    char content[4096];
-    safe_recv(content, client_fd);
+    strncpy(minifs_path, request->args[1], sizeof(minifs_path) - 1);
 
-    if (create_at(minifs_path, REG, content) != 0) {
-        send_failure("perform_get: failed to create regular minifs file", client_fd);
+    // Client sends content right after the command, so all chunks are
+    // received even if the file cannot be written, error is reported once
+    char* chunk = malloc(CHUNK_SIZE);
+    if (chunk == NULL) {
         return -1;
     }
-    
-    dump_info();
 
+    struct fs_file file;
+    int failed = (create_at(minifs_path, REG, NULL) != 0);
+    int created = !failed;
+    if (created && open_file(minifs_path, &file, NULL) != 0) {
+        send_failure("perform_get: file was removed", client_fd);
+        failed = 1;
+    }
+
+    uint64_t offset = 0;
+    int len;
+    while ((len = recv_chunk(chunk, client_fd, CHUNK_SIZE)) > 0) {
+        if (!failed && write_at(&file, offset, chunk, (size_t)len) != 0) {
+            failed = 1;
+        }
+        offset += len;
+    }
+    free(chunk);
+
+    if (len < 0 || failed) {
+        if (created) {
+            dump_info();
+        }
+        return -1;
+    }
+    if (dump_info() != 0) {
+        send_failure("perform_get: cannot commit metadata", client_fd);
+        return -1;
+    }
     send_status(1, client_fd);
     return 0;
 }
 
-int perform_put(struct tokenizer tokenizer, int client_fd) {
-    // Tokens correctness is checked by client
-    struct token* second_token = tokenizer.head->next;
+int perform_put(const struct request* request, int client_fd) {
+    if (request->arg_count != 2) {
+        send_failure("Usage: put <minifs path> <global path>", client_fd);
+        return -1;
+    }
 
     char minifs_path[128];
     memset(minifs_path, 0, sizeof(minifs_path));
-    strncpy(minifs_path, second_token->start, second_token->len);
+    strncpy(minifs_path, request->args[0], sizeof(minifs_path) - 1);
 
-    ssize_t res;
-    if ((res = find_file(minifs_path)) == -1) {
+    struct fs_file file;
+    struct inode inode;
+    if (open_file(minifs_path, &file, &inode) != 0) {
         send_failure("perform_put: file at minifs_path not found", client_fd);
         return -1;
     }
-    int inode_index = (int)res;
-    struct inode* inode = get_inode(inode_index);
 
-    if (inode->type != REG) {
+    if (inode.type != REG) {
         send_failure("perform_put: not a regular file", client_fd);
         return -1;
     }
 
-    char* content = read_file(inode_index);
-    send_success(content, client_fd);
-    
-    free(content);
+    return send_file(&file, &inode, client_fd);
+}
+
+// Handle given as argument, failure is sent if it is not open
+static struct handle* get_handle(const char* arg, int client_fd) {
+    uint64_t id;
+    if (handles == NULL || parse_u64(arg, &id) != 0 || id >= MAX_HANDLES ||
+        !handles->handles[id].used) {
+        send_failure("bad file handle", client_fd);
+        return NULL;
+    }
+    return &handles->handles[id];
+}
+
+// Read from current offset of handle and prefetch the range after it,
+// so sequential reader finds next blocks in memory
+static int read_handle(const struct request* request, int client_fd) {
+    uint64_t len;
+    if (parse_u64(request->args[1], &len) != 0) {
+        send_failure("Usage: read <handle> <len>", client_fd);
+        return -1;
+    }
+    struct handle* handle = get_handle(request->args[0], client_fd);
+    if (handle == NULL) {
+        return -1;
+    }
+    struct inode inode;
+    if (stat_file(&handle->file.ref, &inode) != 0) {
+        send_failure("perform_read: file was removed", client_fd);
+        return -1;
+    }
+
+    uint64_t offset = handle->offset;
+    int result = send_range(&handle->file, &inode, offset, len, client_fd);
+    if (offset < inode.file_len) {
+        handle->offset += (len < inode.file_len - offset) ? len : inode.file_len - offset;
+    }
+
+    uint64_t window = (len < READAHEAD_MAX / 2) ? 2 * len : READAHEAD_MAX;
+    uint64_t ahead = handle->offset + window;
+    if (ahead > handle->readahead) {
+        uint64_t from = (handle->readahead > handle->offset) ? handle->readahead : handle->offset;
+        prefetch_range(&handle->file.ref, from, (size_t)(ahead - from));
+        handle->readahead = ahead;
+    }
+    return result;
+}
+
+int perform_read(const struct request* request, int client_fd) {
+    if (request->arg_count == 2) {
+        return read_handle(request, client_fd);
+    }
+
+    uint64_t offset;
+    uint64_t len;
+    if (request->arg_count != 3 || parse_u64(request->args[1], &offset) != 0 ||
+        parse_u64(request->args[2], &len) != 0) {
+        send_failure("Usage: read <minifs path> <offset> <len>", client_fd);
+        return -1;
+    }
+
+    struct fs_file file;
+    struct inode inode;
+    if (open_regular(request->args[0], "perform_read", &file, &inode, client_fd) != 0) {
+        return -1;
+    }
+
+    // Range past the end of file is cut, as with pread
+    return send_range(&file, &inode, offset, len, client_fd);
+}
+
+// Receive content sent after command and write it to file at offset. As in get,
+// all chunks are received even if nothing can be written (file is NULL then).
+// Return number of written bytes or -1
+static int64_t recv_content(struct fs_file* file, uint64_t offset, int client_fd) {
+    char* chunk = malloc(CHUNK_SIZE);
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    int failed = (file == NULL);
+    uint64_t written = 0;
+    int len;
+    while ((len = recv_chunk(chunk, client_fd, CHUNK_SIZE)) > 0) {
+        if (!failed && write_at(file, offset + written, chunk, (size_t)len) != 0) {
+            failed = 1;
+        }
+        written += len;
+    }
+    free(chunk);
+
+    if (len < 0 || failed) {
+        return -1;
+    }
+    // New length of extended file is committed like in get
+    if (dump_info() != 0) {
+        send_failure("perform_write: cannot commit metadata", client_fd);
+        return -1;
+    }
+    return (int64_t)written;
+}
+
+int perform_write(const struct request* request, int client_fd) {
+    // Client sends content only for well-formed command, the last argument
+    // is the local source file
+    if (request->arg_count == 2) {
+        struct handle* handle = get_handle(request->args[0], client_fd);
+        int64_t written = recv_content((handle != NULL) ? &handle->file : NULL,
+                                       (handle != NULL) ? handle->offset : 0, client_fd);
+        if (written < 0) {
+            return -1;
+        }
+        handle->offset += (uint64_t)written;
+        send_status(1, client_fd);
+        return 0;
+    }
+    if (request->arg_count != 3) {
+        send_failure("Usage: write <minifs path> <offset> <global path>", client_fd);
+        return -1;
+    }
+
+    // Content follows the command anyway, so it is drained after a failure
+    uint64_t offset = 0;
+    if (parse_u64(request->args[1], &offset) != 0) {
+        send_failure("perform_write: offset is not a number", client_fd);
+        recv_content(NULL, 0, client_fd);
+        return -1;
+    }
+    struct fs_file file;
+    struct fs_file* target = &file;
+    if (open_regular(request->args[0], "perform_write", &file, NULL, client_fd) != 0) {
+        target = NULL;
+    }
+
+    if (recv_content(target, offset, client_fd) < 0) {
+        return -1;
+    }
+    send_status(1, client_fd);
     return 0;
-}
\ No newline at end of file
+}
+
+void perform_set_handles(struct handle_table* table) {
+    handles = table;
+}
+
+int perform_open(const struct request* request, int client_fd) {
+    if (request->arg_count != 1) {
+        send_failure("Usage: open <minifs path>", client_fd);
+        return -1;
+    }
+    if (handles == NULL) {
+        send_failure("perform_open: no session", client_fd);
+        return -1;
+    }
+
+    // Lowest free handle is taken, as with descriptors
+    int id = 0;
+    while (id < MAX_HANDLES && handles->handles[id].used) {
+        ++id;
+    }
+    if (id == MAX_HANDLES) {
+        send_failure("perform_open: too many open files", client_fd);
+        return -1;
+    }
+
+    struct handle* handle = &handles->handles[id];
+    if (open_regular(request->args[0], "perform_open", &handle->file, NULL, client_fd) != 0) {
+        return -1;
+    }
+    handle->used = 1;
+    handle->offset = 0;
+    handle->readahead = 0;
+
+    char response[16];
+    snprintf(response, sizeof(response), "%d", id);
+    send_success(response, client_fd);
+    return 0;
+}
+
+int perform_close(const struct request* request, int client_fd) {
+    if (request->arg_count != 1) {
+        send_failure("Usage: close <handle>", client_fd);
+        return -1;
+    }
+    struct handle* handle = get_handle(request->args[0], client_fd);
+    if (handle == NULL) {
+        return -1;
+    }
+    handle->used = 0;
+    send_status(1, client_fd);
+    return 0;
+}
+
+int perform_cd(const struct request* request, int client_fd) {
+    if (request->arg_count > 1) {
+        send_failure("Usage: cd [dir path]", client_fd);
+        return -1;
+    }
+
+    // Without argument session returns to root
+    if (change_dir((request->arg_count == 1) ? request->args[0] : "/") != 0) {
+        return -1;
+    }
+    send_status(1, client_fd);
+    return 0;
+}
+
+int perform_pwd(const struct request* request, int client_fd) {
+    if (request->arg_count != 0) {
+        send_failure("Usage: pwd", client_fd);
+        return -1;
+    }
+    send_success(current_dir(), client_fd);
+    return 0;
+}
+
+size_t format_stats(const struct stats* total, char* buf, size_t len) {
+    size_t pos = stats_format(total, buf, len);
+    struct cache_stats cache = cache_get_stats();
+    struct journal_stats journal = journal_get_stats();
+    int written = snprintf((pos < len) ? buf + pos : NULL, (pos < len) ? len - pos : 0,
+                           "cache: capacity %zu, used %zu, dirty %zu, hits %lu, misses %lu, "
+                           "evictions %lu, writebacks %lu\n"
+                           "journal: commits %lu, records %lu, bytes %lu\n",
+                           cache.capacity, cache.used, cache.dirty, (unsigned long)cache.hits,
+                           (unsigned long)cache.misses, (unsigned long)cache.evictions,
+                           (unsigned long)cache.writebacks, (unsigned long)journal.commits,
+                           (unsigned long)journal.records, (unsigned long)journal.bytes);
+    return pos + ((written > 0) ? (size_t)written : 0);
+}
+
+int perform_stats(const struct request* request, int client_fd) {
+    if (request->arg_count != 0) {
+        send_failure("Usage: stats", client_fd);
+        return -1;
+    }
+
+    struct stats* total = malloc(sizeof(struct stats));
+    if (total == NULL) {
+        send_failure("perform_stats: out of memory", client_fd);
+        return -1;
+    }
+    stats_collect(total);
+    size_t len = format_stats(total, NULL, 0);
+    char* text = malloc(len + 1);
+    if (text == NULL) {
+        free(total);
+        send_failure("perform_stats: out of memory", client_fd);
+        return -1;
+    }
+    format_stats(total, text, len + 1);
+    free(total);
+
+    send_status(1, client_fd);
+    for (size_t pos = 0; pos < len; pos += CHUNK_SIZE) {
+        int chunk = (len - pos < CHUNK_SIZE) ? (int)(len - pos) : CHUNK_SIZE;
+        if (send_chunk(text + pos, client_fd, chunk) != 0) {
+            free(text);
+            return -1;
+        }
+    }
+    free(text);
+    send_chunk_end(client_fd);
+    return 0;
+}
+
+// Apply one operation of batch, return error message or NULL on success
+static const char* apply_batch_op(const struct request* op) {
+    char path[128];
+    memset(path, 0, sizeof(path));
+    strncpy(path, op->args[0], sizeof(path) - 1);
+
+    int result;
+    switch (op->opcode) {
+        case OP_TOUCH:
+            result = create_at(path, REG, NULL);
+            break;
+        case OP_MKDIR:
+            result = create_at(path, DIR, NULL);
+            break;
+        case OP_RM:
+        case OP_RMDIR:
+            result = remove_at(path);
+            break;
+        default:
+            return "operation is not allowed in batch";
+    }
+    if (result == 0) {
+        return NULL;
+    }
+    return (fs_last_error() != NULL) ? fs_last_error() : "operation failed";
+}
+
+int perform_batch(const struct request* request, int client_fd) {
+    if (!request->binary) {
+        send_failure("perform_batch: batch is sent only as binary request", client_fd);
+        return -1;
+    }
+
+    uint32_t op_count;
+    if (recv_all((char*)&op_count, client_fd, sizeof(op_count)) != 0) {
+        return -1;
+    }
+    if (op_count > PROTO_MAX_BATCH) {
+        // Operations cannot be skipped, the rest of stream is unusable
+        shutdown(client_fd, SHUT_RDWR);
+        return -1;
+    }
+
+    // Operations are applied as they arrive and committed once at the end
+    uint32_t failed = 0;
+    uint32_t first_failed = 0;
+    const char* first_error = NULL;
+    struct request op;
+    fs_batch_begin();
+    for (uint32_t i = 0; i < op_count; ++i) {
+        if (recv_batch_op(client_fd, &op) != 0) {
+            fs_batch_end();
+            shutdown(client_fd, SHUT_RDWR);
+            return -1;
+        }
+        const char* error = apply_batch_op(&op);
+        if (error != NULL && failed++ == 0) {
+            first_failed = i;
+            first_error = error;
+        }
+    }
+    fs_batch_end();
+
+    if (failed > 0) {
+        char response[256];
+        snprintf(response, sizeof(response), "batch: %u of %u operations failed, first #%u: %s",
+                 failed, op_count, first_failed, first_error);
+        send_failure(response, client_fd);
+        return -1;
+    }
+    send_status(1, client_fd);
+    return 0;
+}
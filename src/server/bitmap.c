@@ -0,0 +1,203 @@
+#include <stdlib.h>
+
+#include "server/bitmap.h"
+
+// Mask of bits [from, to) inside one word, 0 <= from < to <= 64
+static uint64_t word_mask(size_t from, size_t to) {
+    uint64_t high = (to == BITMAP_WORD_BITS) ? ~0ULL : ((1ULL << to) - 1);
+    return high & ~((1ULL << from) - 1);
+}
+
+// Index of the first bit in [from, to) equal to value, or to if there is none
+static size_t find_next(const struct bitmap* bitmap, size_t from, size_t to, int value) {
+    while (from < to) {
+        size_t word_index = from / BITMAP_WORD_BITS;
+        size_t bit = from % BITMAP_WORD_BITS;
+
+        uint64_t word = bitmap->words[word_index];
+        if (!value) {
+            word = ~word;
+        }
+        word &= word_mask(bit, BITMAP_WORD_BITS);
+
+        if (word != 0) {
+            size_t found = word_index * BITMAP_WORD_BITS + __builtin_ctzll(word);
+            return (found < to) ? found : to;
+        }
+        from = (word_index + 1) * BITMAP_WORD_BITS;
+    }
+    return to;
+}
+
+static void set_range(struct bitmap* bitmap, size_t start, size_t count, int value) {
+    size_t end = start + count;
+    while (start < end) {
+        size_t word_index = start / BITMAP_WORD_BITS;
+        size_t from = start % BITMAP_WORD_BITS;
+        size_t to = end - word_index * BITMAP_WORD_BITS;
+        if (to > BITMAP_WORD_BITS) {
+            to = BITMAP_WORD_BITS;
+        }
+
+        uint64_t mask = word_mask(from, to);
+        if (value) {
+            bitmap->words[word_index] |= mask;
+        } else {
+            bitmap->words[word_index] &= ~mask;
+        }
+        start = (word_index + 1) * BITMAP_WORD_BITS;
+    }
+}
+
+int bitmap_init(struct bitmap* bitmap, size_t bit_count) {
+    bitmap->bit_count = bit_count;
+    bitmap->word_count = BITMAP_WORDS(bit_count);
+    bitmap->hint = 0;
+    bitmap->words = calloc(bitmap->word_count, sizeof(uint64_t));
+    return (bitmap->words == NULL) ? -1 : 0;
+}
+
+void bitmap_free(struct bitmap* bitmap) {
+    free(bitmap->words);
+    bitmap->words = NULL;
+}
+
+void bitmap_attach(struct bitmap* bitmap, uint64_t* words, size_t bit_count) {
+    bitmap->bit_count = bit_count;
+    bitmap->word_count = BITMAP_WORDS(bit_count);
+    bitmap->hint = 0;
+    bitmap->words = words;
+}
+
+size_t bitmap_bytes(const struct bitmap* bitmap) {
+    return bitmap->word_count * sizeof(uint64_t);
+}
+
+int bitmap_test(const struct bitmap* bitmap, size_t bit) {
+    return (bitmap->words[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+void bitmap_set(struct bitmap* bitmap, size_t bit) {
+    bitmap->words[bit / BITMAP_WORD_BITS] |= 1ULL << (bit % BITMAP_WORD_BITS);
+}
+
+void bitmap_clear(struct bitmap* bitmap, size_t bit) {
+    bitmap->words[bit / BITMAP_WORD_BITS] &= ~(1ULL << (bit % BITMAP_WORD_BITS));
+}
+
+void bitmap_clear_range(struct bitmap* bitmap, size_t start, size_t count) {
+    set_range(bitmap, start, count, 0);
+}
+
+void bitmap_set_range(struct bitmap* bitmap, size_t start, size_t count) {
+    set_range(bitmap, start, count, 1);
+}
+
+size_t bitmap_find_next(const struct bitmap* bitmap, size_t from, int value) {
+    return find_next(bitmap, from, bitmap->bit_count, value);
+}
+
+ssize_t bitmap_alloc(struct bitmap* bitmap) {
+    size_t found = find_next(bitmap, bitmap->hint, bitmap->bit_count, 0);
+    if (found == bitmap->bit_count) {
+        found = find_next(bitmap, 0, bitmap->hint, 0);
+        if (found == bitmap->hint) {
+            return -1;
+        }
+    }
+
+    bitmap_set(bitmap, found);
+    bitmap->hint = (found + 1 == bitmap->bit_count) ? 0 : found + 1;
+    return (ssize_t)found;
+}
+
+// Find run of count free bits inside [from, to)
+static size_t find_run(const struct bitmap* bitmap, size_t from, size_t to, size_t count) {
+    while (from < to) {
+        size_t start = find_next(bitmap, from, to, 0);
+        if (start == to) {
+            break;
+        }
+        size_t end = find_next(bitmap, start, to, 1);
+        if (end - start >= count) {
+            return start;
+        }
+        from = end;
+    }
+    return to;
+}
+
+ssize_t bitmap_alloc_range(struct bitmap* bitmap, size_t count) {
+    if (count == 0 || count > bitmap->bit_count) {
+        return -1;
+    }
+
+    size_t found = find_run(bitmap, bitmap->hint, bitmap->bit_count, count);
+    if (found == bitmap->bit_count) {
+        // Run may cross the cursor, so the second pass ends at hint + count
+        size_t to = bitmap->hint + count;
+        if (to > bitmap->bit_count) {
+            to = bitmap->bit_count;
+        }
+        found = find_run(bitmap, 0, to, count);
+        if (found == to) {
+            return -1;
+        }
+    }
+
+    set_range(bitmap, found, count, 1);
+    bitmap->hint = (found + count == bitmap->bit_count) ? 0 : found + count;
+    return (ssize_t)found;
+}
+
+ssize_t bitmap_alloc_longest(struct bitmap* bitmap, size_t max_count, size_t* count) {
+    if (max_count == 0) {
+        return -1;
+    }
+    ssize_t found = bitmap_alloc_range(bitmap, max_count);
+    if (found >= 0) {
+        *count = max_count;
+        return found;
+    }
+
+    size_t best = 0;
+    size_t best_len = 0;
+    size_t from = 0;
+    while (from < bitmap->bit_count) {
+        size_t start = find_next(bitmap, from, bitmap->bit_count, 0);
+        if (start == bitmap->bit_count) {
+            break;
+        }
+        size_t end = find_next(bitmap, start, bitmap->bit_count, 1);
+        if (end - start > best_len) {
+            best = start;
+            best_len = end - start;
+        }
+        from = end;
+    }
+    if (best_len == 0) {
+        return -1;
+    }
+    if (best_len > max_count) {
+        best_len = max_count;
+    }
+
+    set_range(bitmap, best, best_len, 1);
+    bitmap->hint = (best + best_len == bitmap->bit_count) ? 0 : best + best_len;
+    *count = best_len;
+    return (ssize_t)best;
+}
+
+size_t bitmap_alloc_at(struct bitmap* bitmap, size_t start, size_t max_count) {
+    if (start >= bitmap->bit_count) {
+        return 0;
+    }
+    size_t to = (max_count > bitmap->bit_count - start) ? bitmap->bit_count : start + max_count;
+    size_t count = find_next(bitmap, start, to, 1) - start;
+
+    set_range(bitmap, start, count, 1);
+    if (count > 0) {
+        bitmap->hint = (start + count == bitmap->bit_count) ? 0 : start + count;
+    }
+    return count;
+}
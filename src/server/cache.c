@@ -0,0 +1,359 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server/cache.h"
+
+struct cache_entry {
+    int block_index;  // -1 for empty entry
+    int next;         // next entry in hash chain
+    int dirty;
+    int referenced;
+    int meta;
+};
+
+static struct storage* storage;
+static off_t data_offset;
+static size_t block_size;
+
+static size_t capacity;
+static size_t meta_limit;
+static size_t meta_dirty;  // dirty metadata blocks, they wait for journal commit
+static struct cache_entry* entries;
+static char* data;
+
+static int* buckets;
+static size_t bucket_mask;
+
+static size_t clock_hand;
+static struct cache_stats stats;
+
+// Protects entries, hash chains, clock hand and stats. Storage is accessed
+// with positional calls, so whole-block runs are read without holding it
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* entry_data(int entry) {
+    return data + (size_t)entry * block_size;
+}
+
+static off_t block_offset(int block_index) {
+    return data_offset + (off_t)block_index * block_size;
+}
+
+static size_t bucket_of(int block_index) {
+    return ((uint32_t)block_index * 2654435761u) & bucket_mask;
+}
+
+static int lookup(int block_index) {
+    for (int i = buckets[bucket_of(block_index)]; i != -1; i = entries[i].next) {
+        if (entries[i].block_index == block_index) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void unlink_entry(int entry) {
+    int* link = &buckets[bucket_of(entries[entry].block_index)];
+    while (*link != entry) {
+        link = &entries[*link].next;
+    }
+    *link = entries[entry].next;
+
+    entries[entry].block_index = -1;
+    entries[entry].next = -1;
+    --stats.used;
+}
+
+static int is_dirty_meta(int entry) {
+    return entries[entry].dirty && entries[entry].meta;
+}
+
+static void set_clean(int entry) {
+    if (is_dirty_meta(entry)) {
+        --meta_dirty;
+    }
+    entries[entry].dirty = 0;
+    --stats.dirty;
+}
+
+// Metadata blocks are written only through journal, so they are never written back here
+static int write_back(int entry) {
+    if (!entries[entry].dirty || entries[entry].meta) {
+        return 0;
+    }
+    if (storage_write(storage, entry_data(entry), block_size,
+                      block_offset(entries[entry].block_index)) < 0) {
+        return -1;
+    }
+    set_clean(entry);
+    ++stats.writebacks;
+    return 0;
+}
+
+// Find entry for a new block using CLOCK, writing back dirty victim.
+// Dirty metadata blocks are kept until journal commit, at most meta_limit of
+// them leave other entries for victims
+static int get_victim() {
+    for (size_t step = 0; step < 2 * capacity; ++step) {
+        int entry = (int)clock_hand;
+        clock_hand = (clock_hand + 1) % capacity;
+
+        if (entries[entry].block_index == -1) {
+            return entry;
+        }
+        if (entries[entry].referenced) {
+            entries[entry].referenced = 0;
+            continue;
+        }
+        if (is_dirty_meta(entry)) {
+            continue;
+        }
+        if (write_back(entry) < 0) {
+            return -1;
+        }
+        unlink_entry(entry);
+        ++stats.evictions;
+        return entry;
+    }
+    return -1;
+}
+
+// Put block into cache, reading its content from storage if fill is set
+static int insert(int block_index, int fill) {
+    int entry = get_victim();
+    if (entry < 0) {
+        return -1;
+    }
+
+    if (fill) {
+        if (storage_read(storage, entry_data(entry), block_size, block_offset(block_index)) < 0) {
+            return -1;
+        }
+    }
+
+    size_t bucket = bucket_of(block_index);
+    entries[entry].block_index = block_index;
+    entries[entry].next = buckets[bucket];
+    entries[entry].dirty = 0;
+    entries[entry].referenced = 1;
+    entries[entry].meta = 0;
+    buckets[bucket] = entry;
+    ++stats.used;
+    return entry;
+}
+
+int cache_init(struct storage* disk, off_t offset, size_t size, size_t blocks, size_t max_meta) {
+    cache_free();
+    if (blocks == 0 || max_meta == 0 || max_meta >= blocks) {
+        return -1;
+    }
+
+    storage = disk;
+    data_offset = offset;
+    block_size = size;
+    capacity = blocks;
+    meta_limit = max_meta;
+    meta_dirty = 0;
+    clock_hand = 0;
+    memset(&stats, 0, sizeof(stats));
+    stats.capacity = capacity;
+
+    size_t bucket_count = 1;
+    while (bucket_count < 2 * capacity) {
+        bucket_count <<= 1;
+    }
+    bucket_mask = bucket_count - 1;
+
+    entries = malloc(capacity * sizeof(struct cache_entry));
+    data = malloc(capacity * block_size);
+    buckets = malloc(bucket_count * sizeof(int));
+    if (entries == NULL || data == NULL || buckets == NULL) {
+        cache_free();
+        return -1;
+    }
+
+    for (size_t i = 0; i < capacity; ++i) {
+        entries[i].block_index = -1;
+        entries[i].next = -1;
+        entries[i].dirty = 0;
+        entries[i].referenced = 0;
+        entries[i].meta = 0;
+    }
+    for (size_t i = 0; i < bucket_count; ++i) {
+        buckets[i] = -1;
+    }
+    return 0;
+}
+
+void cache_free() {
+    free(entries);
+    free(data);
+    free(buckets);
+    entries = NULL;
+    data = NULL;
+    buckets = NULL;
+    capacity = 0;
+}
+
+int cache_read(int block_index, size_t offset, void* buf, size_t len) {
+    pthread_mutex_lock(&cache_lock);
+    int entry = lookup(block_index);
+    if (entry != -1) {
+        ++stats.hits;
+        entries[entry].referenced = 1;
+    } else {
+        ++stats.misses;
+        entry = insert(block_index, 1);
+    }
+
+    if (entry >= 0) {
+        memcpy(buf, entry_data(entry) + offset, len);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (entry >= 0) ? 0 : -1;
+}
+
+int cache_write(int block_index, size_t offset, const void* buf, size_t len, int meta) {
+    pthread_mutex_lock(&cache_lock);
+    int entry = lookup(block_index);
+    if (meta && (entry == -1 || !is_dirty_meta(entry)) && meta_dirty == meta_limit) {
+        // Block would not fit into the next journal transaction
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    if (entry != -1) {
+        ++stats.hits;
+        entries[entry].referenced = 1;
+    } else {
+        ++stats.misses;
+        // Whole block is overwritten, so there is no need to read it
+        int fill = !(offset == 0 && len == block_size);
+        entry = insert(block_index, fill);
+    }
+
+    if (entry >= 0) {
+        memcpy(entry_data(entry) + offset, buf, len);
+        if (entries[entry].dirty) {
+            set_clean(entry);
+        }
+        entries[entry].meta = meta;
+        entries[entry].dirty = 1;
+        ++stats.dirty;
+        meta_dirty += meta ? 1 : 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (entry >= 0) ? 0 : -1;
+}
+
+int cache_read_blocks(int block_index, int count, void* buf) {
+    char* position = buf;
+    int run_start = 0;  // first block of current uncached run
+    for (int i = 0; i <= count; ++i) {
+        int hit = 0;
+        if (i < count) {
+            pthread_mutex_lock(&cache_lock);
+            int entry = lookup(block_index + i);
+            if (entry != -1) {
+                ++stats.hits;
+                entries[entry].referenced = 1;
+                memcpy(position + (size_t)i * block_size, entry_data(entry), block_size);
+                hit = 1;
+            }
+            pthread_mutex_unlock(&cache_lock);
+        }
+        if (i < count && !hit) {
+            continue;
+        }
+
+        if (run_start < i) {
+            size_t run_len = (size_t)(i - run_start) * block_size;
+            if (storage_read(storage, position + (size_t)run_start * block_size, run_len,
+                             block_offset(block_index + run_start)) < 0) {
+                return -1;
+            }
+        }
+        run_start = i + 1;
+    }
+    return 0;
+}
+
+int cache_write_blocks(int block_index, int count, const void* buf) {
+    // Cached copies are stale after write, dirty data is fully overwritten
+    for (int i = 0; i < count; ++i) {
+        cache_invalidate(block_index + i);
+    }
+    return storage_write(storage, buf, (size_t)count * block_size, block_offset(block_index)) < 0
+               ? -1
+               : 0;
+}
+
+void cache_invalidate(int block_index) {
+    pthread_mutex_lock(&cache_lock);
+    int entry = lookup(block_index);
+    if (entry != -1) {
+        if (entries[entry].dirty) {
+            set_clean(entry);
+        }
+        unlink_entry(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int cache_write_back_blocks(int block_index, int count) {
+    int result = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < count && stats.dirty > 0; ++i) {
+        int entry = lookup(block_index + i);
+        if (entry != -1 && write_back(entry) < 0) {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+int cache_flush_data() {
+    int result = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < capacity; ++i) {
+        if (entries[i].block_index != -1 && write_back((int)i) < 0) {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+int cache_journal_meta(int (*add)(int block_index, const char* data)) {
+    int result = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < capacity && result == 0; ++i) {
+        if (entries[i].block_index != -1 && is_dirty_meta((int)i)) {
+            result = add(entries[i].block_index, entry_data((int)i));
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return (result == 0) ? 0 : -1;
+}
+
+void cache_mark_meta_clean() {
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < capacity; ++i) {
+        if (entries[i].block_index != -1 && is_dirty_meta((int)i)) {
+            set_clean((int)i);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+size_t cache_meta_limit() {
+    return meta_limit;
+}
+
+struct cache_stats cache_get_stats() {
+    pthread_mutex_lock(&cache_lock);
+    struct cache_stats result = stats;
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
@@ -0,0 +1,103 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server/dcache.h"
+#include "server/fs.h"
+
+struct dcache_entry {
+    int valid;
+    int parent;
+    uint32_t parent_generation;
+    int inode;
+    uint32_t inode_generation;
+    char name[NAME_LEN];
+};
+
+static struct dcache_entry entries[DCACHE_SIZE];
+static uint32_t* generations;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t slot_of(int parent, const char* name) {
+    uint32_t hash = 2166136261u ^ (uint32_t)parent;
+    for (; *name != '\0'; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash % DCACHE_SIZE;
+}
+
+static int cacheable(const char* name) {
+    return strlen(name) < NAME_LEN;
+}
+
+int dcache_init(size_t inode_count) {
+    dcache_free();
+    generations = calloc(inode_count, sizeof(uint32_t));
+    if (generations == NULL) {
+        return -1;
+    }
+    memset(entries, 0, sizeof(entries));
+    return 0;
+}
+
+void dcache_free() {
+    free(generations);
+    generations = NULL;
+}
+
+int dcache_lookup(int parent, const char* name, int* inode) {
+    if (!cacheable(name)) {
+        return 0;
+    }
+
+    int found = 0;
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry* entry = &entries[slot_of(parent, name)];
+    if (entry->valid && entry->parent == parent && strcmp(entry->name, name) == 0) {
+        if (entry->parent_generation != generations[parent] ||
+            (entry->inode != -1 && entry->inode_generation != generations[entry->inode])) {
+            entry->valid = 0;
+        } else {
+            *inode = entry->inode;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return found;
+}
+
+void dcache_insert(int parent, const char* name, int inode) {
+    if (!cacheable(name)) {
+        return;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry* entry = &entries[slot_of(parent, name)];
+    entry->valid = 1;
+    entry->parent = parent;
+    entry->parent_generation = generations[parent];
+    entry->inode = inode;
+    entry->inode_generation = (inode != -1) ? generations[inode] : 0;
+    strcpy(entry->name, name);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_remove(int parent, const char* name) {
+    if (!cacheable(name)) {
+        return;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    struct dcache_entry* entry = &entries[slot_of(parent, name)];
+    if (entry->valid && entry->parent == parent && strcmp(entry->name, name) == 0) {
+        entry->valid = 0;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_invalidate_inode(int inode) {
+    pthread_mutex_lock(&dcache_lock);
+    ++generations[inode];
+    pthread_mutex_unlock(&dcache_lock);
+}
@@ -0,0 +1,201 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "server/bitmap.h"
+#include "server/discard.h"
+
+#define DISCARD_RUN 256  // blocks zeroed by one storage call
+
+static enum discard_mode mode = DISCARD_DEFERRED;
+static enum discard_mode active_mode;
+
+static struct storage* storage;
+static off_t data_offset;
+static size_t block_size;
+
+// Blocks freed since the last commit. They are zeroed only after the commit
+// which frees them, so recovery never finds a live file with zeroed blocks
+static struct bitmap freed;
+
+// Freed blocks waiting for background thread and the run it is zeroing now,
+// cancel of a block in that run waits until it is done
+static struct bitmap pending;
+static size_t pending_count;
+static size_t busy_start;
+static size_t busy_end;
+static int stopping;
+static int running;
+static pthread_t thread;
+static pthread_mutex_t discard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t discard_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t run_done = PTHREAD_COND_INITIALIZER;
+
+static void zero_blocks(uint32_t block_index, uint32_t count) {
+    if (storage_discard(storage, data_offset + (off_t)block_index * block_size,
+                        (size_t)count * block_size) != 0) {
+        perror("discard");
+    }
+}
+
+static void* discard_thread(void* arg) {
+    (void)arg;
+    size_t cursor = 0;
+
+    pthread_mutex_lock(&discard_lock);
+    while (1) {
+        while (pending_count == 0 && !stopping) {
+            pthread_cond_wait(&discard_wakeup, &discard_lock);
+        }
+        if (pending_count == 0) {
+            break;
+        }
+
+        size_t start = bitmap_find_next(&pending, cursor, 1);
+        if (start == pending.bit_count) {
+            start = bitmap_find_next(&pending, 0, 1);
+        }
+        size_t end = bitmap_find_next(&pending, start, 0);
+        if (end - start > DISCARD_RUN) {
+            end = start + DISCARD_RUN;
+        }
+
+        bitmap_clear_range(&pending, start, end - start);
+        pending_count -= end - start;
+        busy_start = start;
+        busy_end = end;
+        cursor = end;
+
+        pthread_mutex_unlock(&discard_lock);
+        zero_blocks((uint32_t)start, (uint32_t)(end - start));
+        pthread_mutex_lock(&discard_lock);
+
+        busy_start = busy_end = 0;
+        pthread_cond_broadcast(&run_done);
+    }
+    pthread_mutex_unlock(&discard_lock);
+    return NULL;
+}
+
+int discard_parse_mode(const char* name, enum discard_mode* result) {
+    if (strcmp(name, "sync") == 0) {
+        *result = DISCARD_SYNC;
+        return 0;
+    }
+    if (strcmp(name, "deferred") == 0) {
+        *result = DISCARD_DEFERRED;
+        return 0;
+    }
+    if (strcmp(name, "lazy") == 0) {
+        *result = DISCARD_LAZY;
+        return 0;
+    }
+    return -1;
+}
+
+void discard_set_mode(enum discard_mode new_mode) {
+    mode = new_mode;
+}
+
+int discard_init(struct storage* disk, off_t offset, size_t size, uint32_t block_count) {
+    discard_free();
+
+    storage = disk;
+    data_offset = offset;
+    block_size = size;
+    active_mode = mode;
+    if (active_mode == DISCARD_LAZY) {
+        return 0;
+    }
+    if (bitmap_init(&freed, block_count) != 0) {
+        return -1;
+    }
+    if (active_mode != DISCARD_DEFERRED) {
+        return 0;
+    }
+
+    if (bitmap_init(&pending, block_count) != 0) {
+        bitmap_free(&freed);
+        return -1;
+    }
+    pending_count = 0;
+    busy_start = busy_end = 0;
+    stopping = 0;
+    if (pthread_create(&thread, NULL, discard_thread, NULL) != 0) {
+        bitmap_free(&freed);
+        bitmap_free(&pending);
+        return -1;
+    }
+    running = 1;
+    return 0;
+}
+
+void discard_free() {
+    bitmap_free(&freed);
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&discard_lock);
+    stopping = 1;
+    pthread_cond_signal(&discard_wakeup);
+    pthread_mutex_unlock(&discard_lock);
+
+    pthread_join(thread, NULL);
+    bitmap_free(&pending);
+    running = 0;
+}
+
+void discard_blocks(uint32_t block_index, uint32_t count) {
+    if (active_mode == DISCARD_LAZY) {
+        return;
+    }
+    pthread_mutex_lock(&discard_lock);
+    bitmap_set_range(&freed, block_index, count);
+    pthread_mutex_unlock(&discard_lock);
+}
+
+void discard_commit() {
+    if (active_mode == DISCARD_LAZY) {
+        return;
+    }
+    pthread_mutex_lock(&discard_lock);
+    size_t start = 0;
+    while ((start = bitmap_find_next(&freed, start, 1)) < freed.bit_count) {
+        size_t end = bitmap_find_next(&freed, start, 0);
+        bitmap_clear_range(&freed, start, end - start);
+        if (active_mode == DISCARD_SYNC) {
+            zero_blocks((uint32_t)start, (uint32_t)(end - start));
+        } else {
+            bitmap_set_range(&pending, start, end - start);
+            pending_count += end - start;
+        }
+        start = end;
+    }
+    if (pending_count > 0) {
+        pthread_cond_signal(&discard_wakeup);
+    }
+    pthread_mutex_unlock(&discard_lock);
+}
+
+void discard_cancel(uint32_t block_index, uint32_t count) {
+    if (active_mode == DISCARD_LAZY) {
+        return;
+    }
+    size_t end = (size_t)block_index + count;
+    pthread_mutex_lock(&discard_lock);
+    bitmap_clear_range(&freed, block_index, count);
+    if (active_mode == DISCARD_SYNC) {
+        pthread_mutex_unlock(&discard_lock);
+        return;
+    }
+    size_t bit = bitmap_find_next(&pending, block_index, 1);
+    while (bit < end) {
+        bitmap_clear(&pending, bit);
+        --pending_count;
+        bit = bitmap_find_next(&pending, bit + 1, 1);
+    }
+    while (block_index < busy_end && busy_start < end) {
+        pthread_cond_wait(&run_done, &discard_lock);
+    }
+    pthread_mutex_unlock(&discard_lock);
+}
@@ -1,249 +1,1716 @@
+#define _GNU_SOURCE  // writer-preferring rwlock
+
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-#include "server/fs.h"
-#include "common/net_utils.h"
+#include "server/bitmap.h"
+#include "server/cache.h"
+#include "server/dcache.h"
+#include "server/discard.h"
+#include "server/fs.h"
+#include "server/journal.h"
+#include "server/stats.h"
+#include "common/net_utils.h"
+
+struct storage* storage;
+extern _Thread_local int client_fd;
+
+// For convenience, this data is stored both in a file and in the form of structures.
+// the main idea is that the blocks are not stored in RAM
+struct superblock sb;
+
+struct fs_layout layout;
+
+// In-memory copy of metadata region from superblock to the end of inode table.
+// Bitmaps and inode table point into it, changed sectors are tracked in dirty_sectors
+char* metadata;
+size_t metadata_len;
+struct bitmap dirty_sectors;
+
+struct bitmap inode_bitmap;
+struct inode* inode_table;
+
+struct bitmap block_bitmap;
+
+char* zero_block;
+
+// Group commit: operations finished while a commit is running are
+// committed together by the next one
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+uint64_t commit_requested;
+uint64_t commit_completed;
+int commit_running;
+int commit_result;  // of the last commit, waiters covered by it return it
+
+// Operations hold fs_lock shared, commit takes it exclusively to capture
+// consistent metadata. Inode locks are taken from parent to child, alloc_lock
+// protects bitmaps, free counters in superblock and dirty sectors
+pthread_rwlock_t fs_lock;
+pthread_rwlock_t* inode_locks;
+
+// Bumped under write lock of inode when its blocks are released,
+// block maps cached for it become stale
+uint32_t* map_versions;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Inside batch operations are committed together and their errors are not sent
+static _Thread_local int batch_depth;
+static _Thread_local const char* last_error;
+static _Thread_local int error_pending;  // recorded by operation, not sent yet
+
+// Working directory of client served by this thread
+static _Thread_local struct fs_cwd* cwd;
+
+static void truncate_blocks(struct inode* inode, uint32_t keep);
+static int write_data(int inode_index, uint64_t offset, const char* data, size_t len);
+static int create_in(int parent_inode, const char* name, int type, char* content);
+static int remove_from(int parent_inode, const char* name);
+
+// Error is only recorded here: it is sent by report() once the operation
+// releases its locks, so a slow client never stalls other operations
+static void fs_fail(const char* msg) {
+    last_error = msg;
+    error_pending = 1;
+}
+
+// Send error of failed operation to client unless it is a part of batch.
+// Called by public operations after unlock, errors of fallbacks which did
+// not fail the operation are dropped
+static int report(int result) {
+    if (result != 0 && error_pending && batch_depth == 0) {
+        send_failure(last_error, client_fd);
+    }
+    error_pending = 0;
+    return result;
+}
+
+const char* fs_last_error() {
+    return last_error;
+}
+
+void fs_batch_begin() {
+    ++batch_depth;
+}
+
+int fs_batch_end() {
+    --batch_depth;
+    return (batch_depth == 0) ? dump_info() : 0;
+}
+
+struct inode* get_inode(int inode_index) {
+    return &inode_table[inode_index];
+}
+
+static void lock_fs() {
+    pthread_rwlock_rdlock(&fs_lock);
+}
+
+static void unlock_fs() {
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+static void lock_inode(int inode_index, int write) {
+    if (write) {
+        pthread_rwlock_wrlock(&inode_locks[inode_index]);
+    } else {
+        pthread_rwlock_rdlock(&inode_locks[inode_index]);
+    }
+}
+
+static void unlock_inode(int inode_index) {
+    pthread_rwlock_unlock(&inode_locks[inode_index]);
+}
+
+// Lock inode of ref, fail if it was removed after lookup
+static int lock_ref(const struct inode_ref* ref, int write) {
+    if (ref->index < 0 || (uint32_t)ref->index >= sb.inode_count) {
+        return -1;
+    }
+    lock_inode(ref->index, write);
+    if (inode_table[ref->index].generation != ref->generation) {
+        unlock_inode(ref->index);
+        return -1;
+    }
+    return 0;
+}
+
+static off_t inode_offset(int inode_index) {
+    return layout.inode_table_offset + (off_t)inode_index * sb.inode_size;
+}
+
+// Remember that metadata at [offset, offset + len) on disk is changed,
+// alloc_lock is held by caller
+static void mark_dirty(off_t offset, size_t len) {
+    size_t first = (offset - SUPERBLOCK_OFFSET) / SECTOR_SIZE;
+    size_t last = (offset - SUPERBLOCK_OFFSET + len - 1) / SECTOR_SIZE;
+    bitmap_set_range(&dirty_sectors, first, last - first + 1);
+}
+
+static void mark_inode_dirty(int inode_index) {
+    pthread_mutex_lock(&alloc_lock);
+    mark_dirty(inode_offset(inode_index), sb.inode_size);
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+// Bitmap bits changed together with free counters in superblock
+static void mark_bitmap_dirty(off_t bitmap_offset, size_t start, size_t count) {
+    size_t first_word = start / BITMAP_WORD_BITS;
+    size_t last_word = (start + count - 1) / BITMAP_WORD_BITS;
+    mark_dirty(bitmap_offset + first_word * sizeof(uint64_t),
+               (last_word - first_word + 1) * sizeof(uint64_t));
+    mark_dirty(SUPERBLOCK_OFFSET, sizeof(struct superblock));
+}
+
+ssize_t get_free_inode_index() {
+    uint64_t start = stats_now();
+    pthread_mutex_lock(&alloc_lock);
+    ssize_t inode_index = bitmap_alloc(&inode_bitmap);
+    if (inode_index >= 0) {
+        --sb.free_inode_count;
+        mark_bitmap_dirty(layout.inode_bitmap_offset, inode_index, 1);
+        mark_dirty(inode_offset(inode_index), sb.inode_size);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    stats_record(STATS_INODE_ALLOC, start, 0);
+    return inode_index;
+}
+
+// Caller holds write lock of inode
+void free_inode(int inode_index) {
+    uint64_t start = stats_now();
+    struct inode* inode = &inode_table[inode_index];
+
+    // Clear blocks
+    truncate_blocks(inode, 0);
+
+    // Clear inode in array, references to it become stale
+    uint32_t generation = inode->generation + 1;
+    memset(inode, 0, sizeof(struct inode));
+    inode->generation = generation;
+
+    pthread_mutex_lock(&alloc_lock);
+    bitmap_clear(&inode_bitmap, inode_index);
+    ++sb.free_inode_count;
+    mark_bitmap_dirty(layout.inode_bitmap_offset, inode_index, 1);
+    mark_dirty(inode_offset(inode_index), sb.inode_size);
+    pthread_mutex_unlock(&alloc_lock);
+    stats_record(STATS_INODE_FREE, start, 0);
+}
+
+ssize_t get_free_block_index() {
+    uint64_t start = stats_now();
+    pthread_mutex_lock(&alloc_lock);
+    ssize_t block_index = bitmap_alloc(&block_bitmap);
+    if (block_index >= 0) {
+        --sb.free_block_count;
+        mark_bitmap_dirty(layout.block_bitmap_offset, block_index, 1);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (block_index >= 0) {
+        discard_cancel((uint32_t)block_index, 1);
+    }
+    stats_record(STATS_BLOCK_ALLOC, start, (block_index >= 0) ? 1 : 0);
+    return block_index;
+}
+
+ssize_t get_free_blocks(int count) {
+    uint64_t start = stats_now();
+    pthread_mutex_lock(&alloc_lock);
+    ssize_t block_index = bitmap_alloc_range(&block_bitmap, count);
+    if (block_index >= 0) {
+        sb.free_block_count -= count;
+        mark_bitmap_dirty(layout.block_bitmap_offset, block_index, count);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (block_index >= 0) {
+        discard_cancel((uint32_t)block_index, (uint32_t)count);
+    }
+    stats_record(STATS_BLOCK_ALLOC, start, (block_index >= 0) ? (uint64_t)count : 0);
+    return block_index;
+}
+
+// Allocate count contiguous blocks, or the longest free run if there is no
+// such run. Its length is stored to got
+static ssize_t get_free_run(uint32_t count, uint32_t* got) {
+    uint64_t start = stats_now();
+    size_t len = 0;
+    pthread_mutex_lock(&alloc_lock);
+    ssize_t block_index = bitmap_alloc_longest(&block_bitmap, count, &len);
+    if (block_index >= 0) {
+        sb.free_block_count -= len;
+        mark_bitmap_dirty(layout.block_bitmap_offset, block_index, len);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (block_index >= 0) {
+        discard_cancel((uint32_t)block_index, (uint32_t)len);
+    }
+    stats_record(STATS_BLOCK_ALLOC, start, len);
+    *got = (uint32_t)len;
+    return block_index;
+}
+
+// Allocate up to count free blocks starting exactly at start
+static size_t get_free_blocks_at(uint32_t start, uint32_t count) {
+    uint64_t start_ns = stats_now();
+    pthread_mutex_lock(&alloc_lock);
+    size_t got = bitmap_alloc_at(&block_bitmap, start, count);
+    if (got > 0) {
+        sb.free_block_count -= got;
+        mark_bitmap_dirty(layout.block_bitmap_offset, start, got);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (got > 0) {
+        discard_cancel(start, (uint32_t)got);
+    }
+    stats_record(STATS_BLOCK_ALLOC, start_ns, got);
+    return got;
+}
+
+void free_blocks(int block_index, int count) {
+    uint64_t start = stats_now();
+    for (int i = 0; i < count; ++i) {
+        // Cached copy must not be written back over the cleared block
+        cache_invalidate(block_index + i);
+    }
+    // Blocks are zeroed once their free is committed or never in lazy mode,
+    // new owner writes every block before reading it
+    discard_blocks((uint32_t)block_index, (uint32_t)count);
+
+    pthread_mutex_lock(&alloc_lock);
+    bitmap_clear_range(&block_bitmap, block_index, count);
+    sb.free_block_count += count;
+    mark_bitmap_dirty(layout.block_bitmap_offset, block_index, count);
+    pthread_mutex_unlock(&alloc_lock);
+    stats_record(STATS_BLOCK_FREE, start, (uint64_t)count);
+}
+
+void free_block(int block_index) {
+    free_blocks(block_index, 1);
+}
+
+static uint32_t file_blocks(uint64_t file_len) {
+    return (uint32_t)((file_len + sb.block_size - 1) / sb.block_size);
+}
+
+static int is_inline(const struct inode* inode) {
+    return (inode->flags & INODE_INLINE) != 0;
+}
+
+static char* inline_data(struct inode* inode) {
+    return (char*)inode->extents;
+}
+
+static uint32_t max_extents() {
+    return INODE_EXTENTS + sb.block_size / sizeof(struct extent);
+}
+
+static int get_extent(struct inode* inode, uint32_t index, struct extent* extent) {
+    if (index < INODE_EXTENTS) {
+        *extent = inode->extents[index];
+        return 0;
+    }
+    return cache_read(inode->extent_block, (index - INODE_EXTENTS) * sizeof(struct extent),
+                      extent, sizeof(struct extent));
+}
+
+static int set_extent(struct inode* inode, uint32_t index, const struct extent* extent) {
+    if (index < INODE_EXTENTS) {
+        inode->extents[index] = *extent;
+        return 0;
+    }
+    return cache_write(inode->extent_block, (index - INODE_EXTENTS) * sizeof(struct extent),
+                       extent, sizeof(struct extent), 1);
+}
+
+// Find extent holding logical block scanning from extent index, first is
+// logical index of its first block. Both are left pointing at found extent
+static int find_extent(struct inode* inode, uint32_t logical, uint32_t* index, uint32_t* first,
+                       struct extent* extent) {
+    for (; *index < inode->extent_count; ++*index) {
+        if (get_extent(inode, *index, extent) != 0) {
+            return -1;
+        }
+        if (logical < *first + extent->len) {
+            return 0;
+        }
+        *first += extent->len;
+    }
+    return -1;
+}
+
+// Find physical block for logical block of file and store to run
+// how many blocks starting from it are contiguous
+static ssize_t map_block(struct inode* inode, uint32_t logical, uint32_t* run) {
+    uint32_t index = 0;
+    uint32_t first = 0;
+    struct extent extent;
+    if (find_extent(inode, logical, &index, &first, &extent) != 0) {
+        return -1;
+    }
+    *run = first + extent.len - logical;
+    return extent.start + (logical - first);
+}
+
+// map_block which starts from extent remembered in map when it is not after
+// logical block. Only the last extent grows, so position of remembered one
+// stays valid until blocks are released
+static ssize_t map_file_block(int inode_index, uint32_t logical, uint32_t* run,
+                              struct block_map* map) {
+    struct inode* inode = &inode_table[inode_index];
+    if (map == NULL) {
+        return map_block(inode, logical, run);
+    }
+
+    uint32_t index = 0;
+    uint32_t first = 0;
+    if (map->valid && map->version == map_versions[inode_index] && logical >= map->first) {
+        index = map->extent;
+        first = map->first;
+    }
+    struct extent extent;
+    if (find_extent(inode, logical, &index, &first, &extent) != 0) {
+        map->valid = 0;
+        return -1;
+    }
+    map->valid = 1;
+    map->version = map_versions[inode_index];
+    map->extent = index;
+    map->first = first;
+
+    *run = first + extent.len - logical;
+    return extent.start + (logical - first);
+}
+
+// Release blocks of inode after the first keep ones
+static void truncate_blocks(struct inode* inode, uint32_t keep) {
+    ++map_versions[inode - inode_table];
+
+    uint32_t first = 0;
+    uint32_t new_count = 0;
+    for (uint32_t i = 0; i < inode->extent_count; ++i) {
+        struct extent extent;
+        get_extent(inode, i, &extent);
+
+        uint32_t kept = (keep > first) ? keep - first : 0;
+        first += extent.len;
+        if (kept >= extent.len) {
+            new_count = i + 1;
+            continue;
+        }
+
+        if (kept > 0) {
+            // Blocks stay in file if its extent cannot be shortened
+            struct extent shorter = {.start = extent.start, .len = kept};
+            new_count = i + 1;
+            if (set_extent(inode, i, &shorter) != 0) {
+                continue;
+            }
+        }
+        free_blocks(extent.start + kept, extent.len - kept);
+    }
+
+    if (inode->extent_count > INODE_EXTENTS && new_count <= INODE_EXTENTS) {
+        free_block(inode->extent_block);
+        inode->extent_block = 0;
+    }
+    inode->extent_count = new_count;
+}
+
+static int add_extent(struct inode* inode, const struct extent* extent) {
+    if (inode->extent_count == max_extents()) {
+        fs_fail("write_to_file: file is too fragmented");
+        return -1;
+    }
+    if (inode->extent_count == INODE_EXTENTS) {
+        ssize_t res;
+        if ((res = get_free_block_index()) < 0) {
+            fs_fail("write_to_file: no free blocks");
+            return -1;
+        }
+        // Whole block is written, so old contents are not read back into cache
+        if (cache_write((int)res, 0, zero_block, sb.block_size, 1) != 0) {
+            free_block((int)res);
+            fs_fail("write_to_file: cannot write extent block");
+            return -1;
+        }
+        inode->extent_block = (uint32_t)res;
+    }
+    if (set_extent(inode, inode->extent_count, extent) != 0) {
+        fs_fail("write_to_file: cannot write extent block");
+        if (inode->extent_count == INODE_EXTENTS) {
+            free_block(inode->extent_block);
+            inode->extent_block = 0;
+        }
+        return -1;
+    }
+    ++inode->extent_count;
+    return 0;
+}
+
+// Allocate count blocks at the end of file. New blocks continue the last
+// extent when possible, so sequentially written files stay contiguous
+static int append_blocks(struct inode* inode, uint32_t count) {
+    // Counter is only a hint here, other writers may take blocks concurrently
+    pthread_mutex_lock(&alloc_lock);
+    uint32_t free_count = sb.free_block_count;
+    pthread_mutex_unlock(&alloc_lock);
+    if (count > free_count) {
+        fs_fail("write_to_file: no free blocks");
+        return -1;
+    }
+
+    uint32_t old_blocks = file_blocks(inode->file_len);
+    while (count > 0) {
+        if (inode->extent_count > 0) {
+            struct extent last;
+            get_extent(inode, inode->extent_count - 1, &last);
+
+            size_t got = get_free_blocks_at(last.start + last.len, count);
+            if (got > 0) {
+                last.len += got;
+                if (set_extent(inode, inode->extent_count - 1, &last) != 0) {
+                    free_blocks((int)(last.start + last.len - got), (int)got);
+                    fs_fail("write_to_file: cannot write extent block");
+                    truncate_blocks(inode, old_blocks);
+                    return -1;
+                }
+                count -= got;
+                continue;
+            }
+        }
+
+        // Take the longest free run which is not longer than needed
+        struct extent extent;
+        ssize_t res = get_free_run(count, &extent.len);
+        if (res < 0) {
+            fs_fail("write_to_file: no free blocks");
+            truncate_blocks(inode, old_blocks);
+            return -1;
+        }
+        extent.start = (uint32_t)res;
+
+        if (add_extent(inode, &extent) != 0) {
+            free_blocks(extent.start, extent.len);
+            truncate_blocks(inode, old_blocks);
+            return -1;
+        }
+        count -= extent.len;
+    }
+    return 0;
+}
+
+// Inline file grows past inode: its data is written to new blocks, which
+// replace it in place of extents. Caller holds write lock of inode
+static int move_inline_data(int inode_index) {
+    struct inode* inode = &inode_table[inode_index];
+    char data[INODE_INLINE_LEN];
+    size_t len = (size_t)inode->file_len;
+    memcpy(data, inline_data(inode), len);
+
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->flags &= ~INODE_INLINE;
+    inode->file_len = 0;
+    if (write_data(inode_index, 0, data, len) != 0) {
+        memcpy(inline_data(inode), data, len);
+        inode->flags |= INODE_INLINE;
+        inode->file_len = len;
+        return -1;
+    }
+    return 0;
+}
+
+// Blocks appended for failed write are released, file keeps its length
+static int fail_write(int inode_index, uint32_t have) {
+    fs_fail("write: cannot write block");
+    truncate_blocks(&inode_table[inode_index], have);
+    mark_inode_dirty(inode_index);
+    return -1;
+}
+
+// Write data at offset of file, caller holds write lock of inode
+static int write_mapped(int inode_index, uint64_t offset, const char* data, size_t len,
+                        struct block_map* map) {
+    struct inode* inode = &inode_table[inode_index];
+
+    if (offset > inode->file_len) {
+        fs_fail("write: offset is beyond end of file");
+        return -1;
+    }
+
+    uint64_t end = offset + len;
+    if (is_inline(inode)) {
+        if (end <= INODE_INLINE_LEN) {
+            memcpy(inline_data(inode) + offset, data, len);
+            if (end > inode->file_len) {
+                inode->file_len = end;
+            }
+            mark_inode_dirty(inode_index);
+            return 0;
+        }
+        if (move_inline_data(inode_index) != 0) {
+            return -1;
+        }
+    }
+
+    uint32_t have = file_blocks(inode->file_len);
+    uint32_t need = file_blocks(end);
+    if (need > have && append_blocks(inode, need - have) != 0) {
+        mark_inode_dirty(inode_index);
+        return -1;
+    }
+
+    while (len > 0) {
+        uint32_t run;
+        ssize_t block_index =
+            map_file_block(inode_index, (uint32_t)(offset / sb.block_size), &run, map);
+        if (block_index < 0) {
+            return fail_write(inode_index, have);
+        }
+        size_t in_block = offset % sb.block_size;
+
+        size_t to_write;
+        int written;
+        if (in_block == 0 && len >= sb.block_size && inode->type == REG) {
+            // Whole blocks inside one extent are written by one call,
+            // directory blocks always go through cache to be journaled
+            uint32_t count = (len / sb.block_size < run) ? (uint32_t)(len / sb.block_size) : run;
+            to_write = (size_t)count * sb.block_size;
+            written = cache_write_blocks((int)block_index, (int)count, data);
+        } else {
+            to_write = sb.block_size - in_block;
+            if (len < to_write) {
+                to_write = len;
+            }
+            // New block may hold data of its previous owner, it is replaced by zeros
+            // instead of being read for partial write
+            int meta = (inode->type != REG);
+            written = 0;
+            if (offset / sb.block_size >= have) {
+                written = cache_write((int)block_index, 0, zero_block, sb.block_size, meta);
+            }
+            if (written == 0) {
+                written = cache_write((int)block_index, in_block, data, to_write, meta);
+            }
+        }
+        if (written != 0) {
+            return fail_write(inode_index, have);
+        }
+
+        data += to_write;
+        offset += to_write;
+        len -= to_write;
+    }
+
+    if (end > inode->file_len) {
+        inode->file_len = end;
+        mark_inode_dirty(inode_index);
+    }
+    return 0;
+}
+
+static int write_data(int inode_index, uint64_t offset, const char* data, size_t len) {
+    return write_mapped(inode_index, offset, data, len, NULL);
+}
+
+int write_to_file(char* data, size_t len, int inode_index) {
+    return write_data(inode_index, inode_table[inode_index].file_len, data, len);
+}
+
+int write_range(const struct inode_ref* ref, uint64_t offset, const char* data, size_t len) {
+    lock_fs();
+    if (lock_ref(ref, 1) != 0) {
+        unlock_fs();
+        fs_fail("write: file was removed");
+        return report(-1);
+    }
+    int result = write_data(ref->index, offset, data, len);
+    unlock_inode(ref->index);
+    unlock_fs();
+    return report(result);
+}
+
+// Read from file at offset, caller holds lock of inode
+static ssize_t read_mapped(int inode_index, uint64_t offset, char* buf, size_t len,
+                           struct block_map* map) {
+    struct inode* inode = &inode_table[inode_index];
+
+    if (offset >= inode->file_len) {
+        return 0;
+    }
+    if (len > inode->file_len - offset) {
+        len = inode->file_len - offset;
+    }
+    if (is_inline(inode)) {
+        memcpy(buf, inline_data(inode) + offset, len);
+        return (ssize_t)len;
+    }
+
+    size_t remain = len;
+    while (remain > 0) {
+        uint32_t run;
+        ssize_t block_index =
+            map_file_block(inode_index, (uint32_t)(offset / sb.block_size), &run, map);
+        if (block_index < 0) {
+            return -1;
+        }
+        size_t in_block = offset % sb.block_size;
+
+        size_t to_read;
+        if (in_block == 0 && remain >= sb.block_size) {
+            // Whole blocks inside one extent are read by one call
+            uint32_t count =
+                (remain / sb.block_size < run) ? (uint32_t)(remain / sb.block_size) : run;
+            to_read = (size_t)count * sb.block_size;
+            if (cache_read_blocks((int)block_index, (int)count, buf) != 0) {
+                return -1;
+            }
+        } else {
+            to_read = sb.block_size - in_block;
+            if (remain < to_read) {
+                to_read = remain;
+            }
+            if (cache_read((int)block_index, in_block, buf, to_read) != 0) {
+                return -1;
+            }
+        }
+
+        buf += to_read;
+        offset += to_read;
+        remain -= to_read;
+    }
+    return (ssize_t)len;
+}
+
+static ssize_t read_data(int inode_index, uint64_t offset, char* buf, size_t len) {
+    return read_mapped(inode_index, offset, buf, len, NULL);
+}
+
+ssize_t read_range(const struct inode_ref* ref, uint64_t offset, char* buf, size_t len) {
+    lock_fs();
+    if (lock_ref(ref, 0) != 0) {
+        unlock_fs();
+        return -1;
+    }
+    ssize_t result = read_data(ref->index, offset, buf, len);
+    unlock_inode(ref->index);
+    unlock_fs();
+    return result;
+}
+
+int fs_zero_copy() {
+    return storage->regular;
+}
+
+// Send file data from image, caller holds lock of inode. Blocks are
+// sent as stored, so dirty cached copies are written back first
+static ssize_t sendfile_data(int inode_index, uint64_t offset, size_t len, int out_fd,
+                             struct block_map* map) {
+    struct inode* inode = &inode_table[inode_index];
+
+    if (offset >= inode->file_len) {
+        return 0;
+    }
+    if (len > inode->file_len - offset) {
+        len = inode->file_len - offset;
+    }
+    if (is_inline(inode)) {
+        return send(out_fd, inline_data(inode) + offset, len, MSG_NOSIGNAL);
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        uint32_t run;
+        ssize_t block_index =
+            map_file_block(inode_index, (uint32_t)(offset / sb.block_size), &run, map);
+        if (block_index < 0) {
+            errno = EIO;
+            break;
+        }
+        size_t in_block = offset % sb.block_size;
+        size_t part = (size_t)run * sb.block_size - in_block;
+        if (part > len - done) {
+            part = len - done;
+        }
+
+        uint32_t count = (uint32_t)((in_block + part + sb.block_size - 1) / sb.block_size);
+        if (cache_write_back_blocks((int)block_index, (int)count) != 0) {
+            errno = EIO;
+            break;
+        }
+        ssize_t sent = storage_send(
+            storage, out_fd, layout.data_offset + (off_t)block_index * sb.block_size + in_block,
+            part);
+        if (sent < 0) {
+            break;
+        }
+        done += sent;
+        offset += sent;
+        if ((size_t)sent < part) {
+            return (ssize_t)done;  // socket is full
+        }
+    }
+    return (done > 0 || len == 0) ? (ssize_t)done : -1;
+}
+
+int stat_file(const struct inode_ref* ref, struct inode* stat) {
+    lock_fs();
+    if (lock_ref(ref, 0) != 0) {
+        unlock_fs();
+        return -1;
+    }
+    *stat = inode_table[ref->index];
+    unlock_inode(ref->index);
+    unlock_fs();
+    return 0;
+}
+
+int open_file(const char* path, struct fs_file* file, struct inode* stat) {
+    memset(file, 0, sizeof(struct fs_file));
+    return lookup_file(path, &file->ref, stat);
+}
+
+ssize_t read_at(struct fs_file* file, uint64_t offset, char* buf, size_t len) {
+    lock_fs();
+    if (lock_ref(&file->ref, 0) != 0) {
+        unlock_fs();
+        return -1;
+    }
+    ssize_t result = read_mapped(file->ref.index, offset, buf, len, &file->map);
+    unlock_inode(file->ref.index);
+    unlock_fs();
+    return result;
+}
+
+int write_at(struct fs_file* file, uint64_t offset, const char* data, size_t len) {
+    lock_fs();
+    if (lock_ref(&file->ref, 1) != 0) {
+        unlock_fs();
+        fs_fail("write: file was removed");
+        return report(-1);
+    }
+    int result = write_mapped(file->ref.index, offset, data, len, &file->map);
+    unlock_inode(file->ref.index);
+    unlock_fs();
+    return report(result);
+}
+
+ssize_t sendfile_at(struct fs_file* file, uint64_t offset, size_t len, int out_fd) {
+    lock_fs();
+    if (lock_ref(&file->ref, 0) != 0) {
+        unlock_fs();
+        errno = ENOENT;
+        return -1;
+    }
+    ssize_t result = sendfile_data(file->ref.index, offset, len, out_fd, &file->map);
+    int saved_errno = errno;
+    unlock_inode(file->ref.index);
+    unlock_fs();
+    errno = saved_errno;
+    return result;
+}
+
+static void prefetch_data(int inode_index, uint64_t offset, size_t len) {
+    struct inode* inode = &inode_table[inode_index];
+
+    if (offset >= inode->file_len || len == 0 || is_inline(inode)) {
+        return;
+    }
+    if (len > inode->file_len - offset) {
+        len = inode->file_len - offset;
+    }
+
+    uint32_t logical = (uint32_t)(offset / sb.block_size);
+    uint32_t last = (uint32_t)((offset + len - 1) / sb.block_size);
+    while (logical <= last) {
+        uint32_t run;
+        ssize_t block_index = map_block(inode, logical, &run);
+        if (block_index < 0) {
+            return;
+        }
+        uint32_t count = (last - logical + 1 < run) ? last - logical + 1 : run;
+        storage_prefetch(storage, layout.data_offset + (off_t)block_index * sb.block_size,
+                         (size_t)count * sb.block_size);
+        logical += count;
+    }
+}
+
+void prefetch_range(const struct inode_ref* ref, uint64_t offset, size_t len) {
+    lock_fs();
+    if (lock_ref(ref, 0) == 0) {
+        prefetch_data(ref->index, offset, len);
+        unlock_inode(ref->index);
+    }
+    unlock_fs();
+}
+
+// Caller holds write lock of inode
+static void cut_file(int inode_index, uint64_t new_len) {
+    struct inode* inode = &inode_table[inode_index];
+    if (new_len < inode->file_len) {
+        if (is_inline(inode)) {
+            // Cut bytes are not left in inode on disk
+            memset(inline_data(inode) + new_len, 0, inode->file_len - new_len);
+        } else {
+            truncate_blocks(inode, file_blocks(new_len));
+        }
+        inode->file_len = new_len;
+        mark_inode_dirty(inode_index);
+    }
+}
+
+int truncate_file(const struct inode_ref* ref, uint64_t new_len) {
+    lock_fs();
+    if (lock_ref(ref, 1) != 0) {
+        unlock_fs();
+        fs_fail("truncate: file was removed");
+        return report(-1);
+    }
+    cut_file(ref->index, new_len);
+    unlock_inode(ref->index);
+    unlock_fs();
+    return report(0);
+}
+
+// Create root directory in first inode
+int create_root() {
+    struct dir_entry root_dir;
+    strcpy(root_dir.name, "/");
+
+    ssize_t res;
+    if ((res = get_free_inode_index()) < 0) {
+        fs_fail("create_root: no free inodes");
+        return -1;
+    }
+    root_dir.inode_index = (uint16_t)res;
+    assert(root_dir.inode_index == 0);
+
+    struct inode* inode = &inode_table[root_dir.inode_index];
+    inode->type = DIR;
+    inode->file_len = 0;
+    mark_inode_dirty(root_dir.inode_index);
+
+    write_to_file((char*)&root_dir, sizeof(struct dir_entry), root_dir.inode_index);
+    return 0;
+}
+
+static int journal_block(int block_index, const char* data) {
+    return journal_add(layout.data_offset + (off_t)block_index * sb.block_size, data,
+                       sb.block_size);
+}
+
+// Sectors and blocks stay dirty until the transaction is committed, so a
+// failed commit is retried by the next one
+static int write_metadata() {
+    // Data blocks are written back before metadata that references them
+    if (cache_flush_data() != 0) {
+        return -1;
+    }
+
+    memcpy(metadata, &sb, sizeof(struct superblock));
+    journal_begin();
+
+    // Adjacent dirty sectors are written together
+    size_t sector = 0;
+    while ((sector = bitmap_find_next(&dirty_sectors, sector, 1)) < dirty_sectors.bit_count) {
+        size_t end = bitmap_find_next(&dirty_sectors, sector, 0);
+
+        size_t from = sector * SECTOR_SIZE;
+        size_t to = end * SECTOR_SIZE;
+        if (to > metadata_len) {
+            to = metadata_len;
+        }
+        if (journal_add(SUPERBLOCK_OFFSET + (off_t)from, metadata + from, to - from) != 0) {
+            return -1;
+        }
+        sector = end;
+    }
+    if (cache_journal_meta(journal_block) != 0 || journal_commit() != 0) {
+        return -1;
+    }
+
+    bitmap_clear_range(&dirty_sectors, 0, dirty_sectors.bit_count);
+    cache_mark_meta_clean();
+    discard_commit();
+    return 0;
+}
+
+int dump_info() {
+    uint64_t start = stats_now();
+    pthread_mutex_lock(&commit_lock);
+    uint64_t ticket = ++commit_requested;
+    while (commit_completed < ticket) {
+        if (commit_running) {
+            pthread_cond_wait(&commit_done, &commit_lock);
+            continue;
+        }
+
+        // Everything requested before this point is already in memory
+        commit_running = 1;
+        uint64_t target = commit_requested;
+        pthread_mutex_unlock(&commit_lock);
+
+        pthread_rwlock_wrlock(&fs_lock);
+        int result = write_metadata();
+        pthread_rwlock_unlock(&fs_lock);
+
+        pthread_mutex_lock(&commit_lock);
+        commit_running = 0;
+        commit_completed = target;
+        commit_result = result;
+        pthread_cond_broadcast(&commit_done);
+    }
+    int result = commit_result;
+    pthread_mutex_unlock(&commit_lock);
+    stats_record(STATS_FLUSH, start, 0);
+    return result;
+}
+
+// Load bitmaps and inode table for geometry described by sb
+int load_info() {
+    storage_read(storage, metadata, metadata_len, SUPERBLOCK_OFFSET);
+    memcpy(&sb, metadata, sizeof(struct superblock));
+    return 0;
+}
+
+void fs_compute_layout(const struct superblock* sb, struct fs_layout* layout) {
+    layout->block_bitmap_offset = SUPERBLOCK_OFFSET + sizeof(struct superblock);
+    layout->inode_bitmap_offset =
+        layout->block_bitmap_offset + BITMAP_WORDS((off_t)sb->block_count) * sizeof(uint64_t);
+    layout->inode_table_offset =
+        layout->inode_bitmap_offset + BITMAP_WORDS((off_t)sb->inode_count) * sizeof(uint64_t);
+
+    layout->metadata_end = layout->inode_table_offset + (off_t)sb->inode_size * sb->inode_count;
+    layout->journal_offset =
+        (layout->metadata_end + sb->block_size - 1) / sb->block_size * sb->block_size;
+    layout->data_offset = layout->journal_offset + (off_t)sb->journal_blocks * sb->block_size;
+    layout->disk_size = layout->data_offset + (off_t)sb->block_count * sb->block_size;
+}
+
+// Journal space taken by transaction with every metadata sector dirty,
+// each sector is counted as a separate record
+static size_t metadata_journal_len(const struct superblock* sb) {
+    struct fs_layout sb_layout;
+    fs_compute_layout(sb, &sb_layout);
+    size_t len = (size_t)(sb_layout.metadata_end - SUPERBLOCK_OFFSET);
+    size_t sectors = (len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    return sizeof(struct journal_header) + sectors * sizeof(struct journal_record) + len;
+}
+
+// Dirty meta blocks which fit into one transaction next to metadata region
+static size_t journal_meta_blocks(const struct superblock* sb) {
+    size_t size = (size_t)sb->journal_blocks * sb->block_size;
+    size_t fixed = metadata_journal_len(sb);
+    return (size > fixed) ? (size - fixed) / (sizeof(struct journal_record) + sb->block_size) : 0;
+}
+
+uint32_t fs_min_journal_blocks(const struct superblock* sb) {
+    size_t block_len = sizeof(struct journal_record) + sb->block_size;
+    size_t len = metadata_journal_len(sb) + MIN_META_BLOCKS * block_len;
+    return (uint32_t)((len + sb->block_size - 1) / sb->block_size);
+}
+
+int fs_check_geometry(const struct superblock* sb) {
+    if (sb->magic_number != MAGIC_NUMBER || sb->inode_size != sizeof(struct inode)) {
+        return -1;
+    }
+    // Block size is a power of two, so directory entries never cross blocks
+    if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE ||
+        (sb->block_size & (sb->block_size - 1)) != 0) {
+        return -1;
+    }
+    if (sb->block_count == 0 || sb->block_count > INT32_MAX || sb->inode_count == 0 ||
+        sb->inode_count > INT32_MAX) {
+        return -1;
+    }
+    return 0;
+}
+
+static void free_locks() {
+    if (inode_locks == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < sb.inode_count; ++i) {
+        pthread_rwlock_destroy(&inode_locks[i]);
+    }
+    free(inode_locks);
+    free(map_versions);
+    inode_locks = NULL;
+    map_versions = NULL;
+    pthread_rwlock_destroy(&fs_lock);
+}
+
+static int init_locks() {
+    inode_locks = malloc(sb.inode_count * sizeof(pthread_rwlock_t));
+    map_versions = calloc(sb.inode_count, sizeof(uint32_t));
+    if (inode_locks == NULL || map_versions == NULL) {
+        free(inode_locks);
+        free(map_versions);
+        inode_locks = NULL;
+        map_versions = NULL;
+        return -1;
+    }
+    for (uint32_t i = 0; i < sb.inode_count; ++i) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+
+    // Commit must not starve behind a stream of readers
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&fs_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return 0;
+}
+
+// Allocate in-memory structures for geometry stored in sb
+static int setup_geometry(size_t cache_blocks) {
+    fs_compute_layout(&sb, &layout);
+    if (layout.disk_size > (off_t)storage->size) {
+        return -1;
+    }
+
+    free(metadata);
+    free(zero_block);
+    bitmap_free(&dirty_sectors);
+    free_locks();
+
+    metadata_len = layout.metadata_end - SUPERBLOCK_OFFSET;
+    metadata = calloc(1, metadata_len);
+    zero_block = calloc(1, sb.block_size);
+    if (metadata == NULL || zero_block == NULL) {
+        return -1;
+    }
+    if (bitmap_init(&dirty_sectors, (metadata_len + SECTOR_SIZE - 1) / SECTOR_SIZE) != 0) {
+        return -1;
+    }
+
+    bitmap_attach(&block_bitmap,
+                  (uint64_t*)(metadata + (layout.block_bitmap_offset - SUPERBLOCK_OFFSET)),
+                  sb.block_count);
+    bitmap_attach(&inode_bitmap,
+                  (uint64_t*)(metadata + (layout.inode_bitmap_offset - SUPERBLOCK_OFFSET)),
+                  sb.inode_count);
+    inode_table = (struct inode*)(metadata + (layout.inode_table_offset - SUPERBLOCK_OFFSET));
+
+    if (init_locks() != 0) {
+        return -1;
+    }
+
+    // Half of cache is left for data and clean blocks. Transaction is never
+    // split, so dirty meta blocks are also limited by journal size
+    size_t meta_blocks = cache_blocks / 2;
+    if (sb.journal_blocks > 0) {
+        size_t fit = journal_meta_blocks(&sb);
+        if (fit < MIN_META_BLOCKS) {
+            return -1;
+        }
+        meta_blocks = (fit < meta_blocks) ? fit : meta_blocks;
+    }
+    if (cache_blocks < MIN_CACHE_BLOCKS ||
+        cache_init(storage, layout.data_offset, sb.block_size, cache_blocks, meta_blocks) != 0) {
+        return -1;
+    }
+    if (journal_init(storage, layout.journal_offset, (size_t)sb.journal_blocks * sb.block_size) !=
+        0) {
+        return -1;
+    }
+    if (dcache_init(sb.inode_count) != 0) {
+        return -1;
+    }
+    if (discard_init(storage, layout.data_offset, sb.block_size, sb.block_count) != 0) {
+        return -1;
+    }
+    return 0;
+}
 
-int fs_fd;
-extern _Thread_local int client_fd;
+int fs_format(struct storage* disk, uint32_t block_size, uint32_t block_count,
+              uint32_t inode_count, uint32_t journal_blocks, size_t cache_blocks) {
+    storage = disk;
 
-// For convenience, this data is stored both in a file and in the form of structures.
-// the main idea is that the blocks are not stored in RAM
-struct superblock sb;
+    memset(&sb, 0, sizeof(struct superblock));
+    sb.block_count = block_count;
+    sb.inode_count = inode_count;
+    sb.free_inode_count = inode_count;
+    sb.free_block_count = block_count;
+    sb.block_size = block_size;
+    sb.inode_size = sizeof(struct inode);
+    sb.magic_number = MAGIC_NUMBER;
+    sb.journal_blocks = journal_blocks;
+
+    if (fs_check_geometry(&sb) != 0 || setup_geometry(cache_blocks) != 0) {
+        return -1;
+    }
 
-int inode_bitmap[INODE_COUNT];
-struct inode inode_table[INODE_COUNT];
+    char buffer[SUPERBLOCK_OFFSET];
+    memset(buffer, 0, sizeof(buffer));
 
-int block_bitmap[BLOCK_COUNT];
+    storage_write(storage, &buffer[0], sizeof(buffer), 0);
 
-struct inode* get_inode(int inode_index) {
-    return &inode_table[inode_index];
+    // Transaction of previous filesystem must not be replayed
+    if (journal_blocks > 0) {
+        storage_write(storage, zero_block, sb.block_size, layout.journal_offset);
+    }
+
+    // Whole metadata region is written on format
+    bitmap_set_range(&dirty_sectors, 0, dirty_sectors.bit_count);
+
+    create_root();
+
+    return report(dump_info());
 }
 
-ssize_t get_free_inode_index() {
-    for (int i = 0; i < sb.inode_count; ++i) {
-        if (inode_bitmap[i] == 0) {
-            inode_bitmap[i] = 1;
-            --sb.free_inode_count;
-            return i;
+int fs_mount(struct storage* disk, size_t cache_blocks) {
+    storage = disk;
+
+    storage_read(storage, &sb, sizeof(struct superblock), SUPERBLOCK_OFFSET);
+    if (fs_check_geometry(&sb) != 0 || setup_geometry(cache_blocks) != 0) {
+        return -1;
+    }
+
+    // Superblock geometry never changes, other metadata is read after replay
+    if (journal_replay() != 0) {
+        return -1;
+    }
+    return load_info();
+}
+
+int fs_init(struct storage* disk, int client, size_t cache_blocks, int format) {
+    storage = disk;
+    client_fd = client;
+
+    uint32_t block_size = DEFAULT_BLOCK_SIZE;
+    uint32_t block_count = DEFAULT_BLOCK_COUNT;
+    uint32_t inode_count = DEFAULT_INODE_COUNT;
+    uint32_t journal_blocks = DEFAULT_JOURNAL_BLOCKS;
+
+    struct superblock disk_sb;
+    storage_read(storage, &disk_sb, sizeof(struct superblock), SUPERBLOCK_OFFSET);
+    if (fs_check_geometry(&disk_sb) == 0) {
+        if (!format) {
+            return fs_mount(storage, cache_blocks);
         }
+        // Keep geometry chosen by mkfs.minifs
+        block_size = disk_sb.block_size;
+        block_count = disk_sb.block_count;
+        inode_count = disk_sb.inode_count;
+        journal_blocks = disk_sb.journal_blocks;
     }
-    return -1;
+
+    return fs_format(storage, block_size, block_count, inode_count, journal_blocks,
+                     cache_blocks);
 }
 
-void free_inode(int inode_index) {
+int fs_shutdown() {
+    int result = dump_info();
+    discard_free();
+    storage_sync(storage);
+    cache_free();
+    dcache_free();
+    journal_free();
+    bitmap_free(&dirty_sectors);
+    free_locks();
+    free(metadata);
+    free(zero_block);
+    metadata = NULL;
+    inode_table = NULL;
+    zero_block = NULL;
+    return result;
+}
+
+// Read whole file, caller holds lock of inode
+static char* load_file(int inode_index) {
     struct inode* inode = &inode_table[inode_index];
+    char* content = malloc(inode->file_len + 1);
 
-    // Clear blocks
-    int block_count = (int)(inode->file_len / sb.block_count);
-    if ((inode->file_len != 0) && (inode->file_len % sb.block_count == 0)) {
-        --block_count;
+    read_data(inode_index, 0, content, inode->file_len);
+
+    content[inode->file_len] = '\0';
+    return content;
+}
+
+char* read_file(const struct inode_ref* ref, uint64_t* len) {
+    lock_fs();
+    if (lock_ref(ref, 0) != 0) {
+        unlock_fs();
+        return NULL;
     }
-    for (int i = 0; i < block_count; ++i) {
-        free_block(inode->blocks_addr[i]);
+    *len = inode_table[ref->index].file_len;
+    char* content = load_file(ref->index);
+    unlock_inode(ref->index);
+    unlock_fs();
+    return content;
+}
+
+// Directories with more entries than fit into one block get a hash index
+// stored in hidden inode: header followed by open addressing table of slots.
+// Slot keeps hash of name and position of entry in directory (plus one),
+// entries stay in the directory, so listing does not depend on index.
+// Index is accessed under lock of its directory
+struct index_header {
+    uint32_t used;  // live and deleted slots
+    uint32_t capacity;  // power of two
+};
+
+struct index_slot {
+    uint32_t hash;
+    uint32_t entry;
+};
+
+#define SLOT_EMPTY 0
+#define SLOT_DELETED UINT32_MAX
+#define MIN_INDEX_CAPACITY 128
+
+static uint32_t dir_entry_count(int dir_index) {
+    return (uint32_t)(inode_table[dir_index].file_len / sizeof(struct dir_entry));
+}
+
+// FNV-1a
+static uint32_t name_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; ++name) {
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
     }
-    // Clear inode in array
-    memset(&inode_table[inode_index], 0, sizeof(struct inode));
+    return hash;
+}
 
-    inode_bitmap[inode_index] = 0;
-    ++sb.free_inode_count;
+static off_t slot_offset(uint32_t slot) {
+    return (off_t)sizeof(struct index_header) + (off_t)slot * sizeof(struct index_slot);
 }
 
-ssize_t get_free_block_index() {
-    for (int i = 0; i < sb.block_count; ++i) {
-        if (block_bitmap[i] == 0) {
-            block_bitmap[i] = 1;
-            --sb.free_block_count;
-            return i;
+static int read_entry(int dir_index, uint32_t pos, struct dir_entry* entry) {
+    ssize_t got = read_data(dir_index, (uint64_t)pos * sizeof(struct dir_entry), (char*)entry,
+                            sizeof(struct dir_entry));
+    return (got == sizeof(struct dir_entry)) ? 0 : -1;
+}
+
+static int write_entry(int dir_index, uint32_t pos, const struct dir_entry* entry) {
+    return write_data(dir_index, (uint64_t)pos * sizeof(struct dir_entry), (const char*)entry,
+                      sizeof(struct dir_entry));
+}
+
+// Find entry with name through index, store it with its slot and position in directory
+static int index_find(int dir_index, const char* name, struct dir_entry* found, uint32_t* slot_out,
+                      uint32_t* pos_out) {
+    int index = (int)inode_table[dir_index].index_inode;
+    struct index_header header;
+    if (read_data(index, 0, (char*)&header, sizeof(header)) != sizeof(header)) {
+        return -1;
+    }
+
+    uint32_t hash = name_hash(name);
+    uint32_t mask = header.capacity - 1;
+    for (uint32_t i = 0, slot = hash & mask; i < header.capacity; ++i, slot = (slot + 1) & mask) {
+        struct index_slot entry;
+        read_data(index, slot_offset(slot), (char*)&entry, sizeof(entry));
+        if (entry.entry == SLOT_EMPTY) {
+            break;
+        }
+        if (entry.entry == SLOT_DELETED || entry.hash != hash) {
+            continue;
+        }
+
+        if (read_entry(dir_index, entry.entry - 1, found) == 0 && strcmp(found->name, name) == 0) {
+            *slot_out = slot;
+            *pos_out = entry.entry - 1;
+            return 0;
         }
     }
     return -1;
 }
 
-void free_block(int block_index) {
-    // Clear block in memory
-    lseek(fs_fd, DATA_OFFSET + block_index * sb.block_size, SEEK_SET);
-    char values[BLOCK_SIZE];
-    memset(values, 0, sizeof(values));
-    write(fs_fd, &values[0], sizeof(values));
-
-    block_bitmap[block_index] = 0;
-    ++sb.free_block_count;
+// Put entry to table in memory, table is not full
+static void table_insert(struct index_slot* slots, uint32_t capacity, uint32_t hash,
+                         uint32_t pos) {
+    uint32_t slot = hash & (capacity - 1);
+    while (slots[slot].entry != SLOT_EMPTY) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    slots[slot].hash = hash;
+    slots[slot].entry = pos + 1;
 }
 
-int write_to_file(char* data, int len, int inode_index) {
-    struct inode* inode = &inode_table[inode_index];
+// Build index of all entries of directory in memory and write it at once,
+// hidden inode is allocated on first build. Caller holds write lock of directory
+static int build_index(int dir_index) {
+    struct inode* dir = &inode_table[dir_index];
+    uint32_t count = dir_entry_count(dir_index);
+    uint32_t capacity = MIN_INDEX_CAPACITY;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
 
-    if (inode->file_len + len > sb.block_size * ADDR_COUNT) {
-        send_failure("write_to_file: inode address capacity is too small", client_fd);
+    // Whole table is written by one operation, so it leaves room in cache for
+    // dirty blocks of others. Directory is scanned without it
+    size_t len = sizeof(struct index_header) + (size_t)capacity * sizeof(struct index_slot);
+    if ((len + sb.block_size - 1) / sb.block_size > cache_meta_limit() / 2) {
+        fs_fail("create_at: directory index is too big");
         return -1;
     }
-
-    int remain = len;
-    int addr_index = inode->file_len / sb.block_size;
-    if (inode->file_len == 0) {
-        ssize_t res;
-        if ((res = get_free_block_index()) < 0) {
-            send_failure("write_to_file: no free blocks", client_fd);
+    char* table = calloc(1, len);
+    if (table == NULL) {
+        fs_fail("create_at: out of memory");
+        return -1;
+    }
+    struct index_header* header = (struct index_header*)table;
+    struct index_slot* slots = (struct index_slot*)(table + sizeof(struct index_header));
+    header->used = count;
+    header->capacity = capacity;
+
+    struct dir_entry* entries = (struct dir_entry*)load_file(dir_index);
+    for (uint32_t i = 0; i < count; ++i) {
+        table_insert(slots, capacity, name_hash(entries[i].name), i);
+    }
+    free(entries);
+
+    int index = (int)dir->index_inode;
+    if (index == 0) {
+        ssize_t res = get_free_inode_index();
+        if (res < 0) {
+            free(table);
+            fs_fail("create_at: no free inodes");
             return -1;
         }
-        int new_block = res;
-        inode->blocks_addr[0] = new_block;
-    }
-    if (inode->file_len % sb.block_size == 0 && inode->file_len != 0) {
-        --addr_index;
+        index = (int)res;
+
+        lock_inode(index, 1);
+        inode_table[index].type = DIR_INDEX;
+        inode_table[index].file_len = 0;
+        unlock_inode(index);
+        dir->index_inode = (uint32_t)index;
+        mark_inode_dirty(dir_index);
     }
 
-    while (remain > 0) {
-        int block_filled_space = inode->file_len - addr_index * sb.block_size;
-        int block_free_space = sb.block_size - block_filled_space;
+    cut_file(index, 0);
+    int result = write_data(index, 0, table, len);
+    free(table);
+    return result;
+}
 
-        if (block_free_space == 0) {
-            ssize_t res;
-            if ((res = get_free_block_index()) < 0) {
-                send_failure("write_to_file: no free blocks", client_fd);
-                return -1;
-            }
-            int new_block = res;
-            inode->blocks_addr[addr_index + 1] = new_block;
-            ++addr_index;
-            continue;
+// Add slot for entry at pos, table grows when it is 3/4 full
+static int index_insert(int dir_index, const char* name, uint32_t pos) {
+    int index = (int)inode_table[dir_index].index_inode;
+    struct index_header header;
+    if (read_data(index, 0, (char*)&header, sizeof(header)) != sizeof(header)) {
+        return -1;
+    }
+    if (4 * (uint64_t)(header.used + 1) > 3 * (uint64_t)header.capacity) {
+        return build_index(dir_index);  // entry is already in directory
+    }
+
+    uint32_t hash = name_hash(name);
+    uint32_t mask = header.capacity - 1;
+    uint32_t slot = hash & mask;
+    struct index_slot entry;
+    while (1) {
+        if (read_data(index, slot_offset(slot), (char*)&entry, sizeof(entry)) != sizeof(entry)) {
+            return -1;
+        }
+        if (entry.entry == SLOT_EMPTY || entry.entry == SLOT_DELETED) {
+            break;
         }
+        slot = (slot + 1) & mask;
+    }
 
-        int to_write = ((remain < block_free_space) ? remain : block_free_space);
+    // Count of used slots must not fall behind, or table would fill up
+    if (entry.entry == SLOT_EMPTY) {
+        ++header.used;
+        if (write_data(index, 0, (const char*)&header, sizeof(header)) != 0) {
+            return -1;
+        }
+    }
+    entry.hash = hash;
+    entry.entry = pos + 1;
+    return write_data(index, slot_offset(slot), (const char*)&entry, sizeof(entry));
+}
 
-        int block_index = inode->blocks_addr[addr_index];
+static int index_set(int dir_index, uint32_t slot, uint32_t hash, uint32_t entry) {
+    struct index_slot value = {.hash = hash, .entry = entry};
+    return write_data((int)inode_table[dir_index].index_inode, slot_offset(slot),
+                      (const char*)&value, sizeof(value));
+}
 
-        lseek(fs_fd, DATA_OFFSET + sb.block_size * block_index + block_filled_space, SEEK_SET);
-        write(fs_fd, data, to_write);
+// Release index of directory, lookups fall back to scanning it.
+// Caller holds write lock of directory
+static void drop_index(int dir_index) {
+    int index = (int)inode_table[dir_index].index_inode;
+    if (index == 0) {
+        return;
+    }
+    lock_inode(index, 1);
+    free_inode(index);
+    unlock_inode(index);
+    inode_table[dir_index].index_inode = 0;
+    mark_inode_dirty(dir_index);
+}
 
-        data += to_write;
-        remain -= to_write;
-        inode->file_len += to_write;
+// Index entry added at pos, directory gets index once it outgrows one block
+static void update_index(int dir_index, const char* name, uint32_t pos) {
+    int result = 0;
+    if (inode_table[dir_index].index_inode != 0) {
+        result = index_insert(dir_index, name, pos);
+    } else if (dir_entry_count(dir_index) > sb.block_size / sizeof(struct dir_entry)) {
+        result = build_index(dir_index);
     }
+    if (result != 0) {
+        drop_index(dir_index);  // stale index would hide entries
+    }
+}
 
-    return 0;
+// Scan directory in small pieces, so only blocks before the entry are read
+static int scan_dir(int dir_index, const char* name, struct dir_entry* found, uint32_t* pos_out) {
+    struct dir_entry entries[64];
+    uint32_t count = dir_entry_count(dir_index);
+    for (uint32_t first = 0; first < count; first += 64) {
+        uint32_t n = (count - first < 64) ? count - first : 64;
+        if (read_data(dir_index, (uint64_t)first * sizeof(struct dir_entry), (char*)entries,
+                      n * sizeof(struct dir_entry)) < 0) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            if (strcmp(entries[i].name, name) == 0) {
+                *found = entries[i];
+                *pos_out = first + i;
+                return 0;
+            }
+        }
+    }
+    return -1;
 }
 
-// Create root directory in first inode
-int create_root() {
-    struct dir_entry root_dir;
-    strcpy(root_dir.name, "/");
+// Find entry and its position through index if directory has one.
+// Slot is set only for indexed directory
+static int lookup_entry(int dir_index, const char* name, struct dir_entry* found, uint32_t* slot,
+                        uint32_t* pos) {
+    if (inode_table[dir_index].index_inode != 0) {
+        return index_find(dir_index, name, found, slot, pos);
+    }
+    return scan_dir(dir_index, name, found, pos);
+}
 
-    ssize_t res;
-    if ((res = get_free_inode_index()) < 0) {
-        send_failure("create_root: no free inodes", client_fd);
+// Find entry with name in directory, caller holds lock of directory
+static int find_entry(int dir_index, const char* name) {
+    if (inode_table[dir_index].type != DIR) {
         return -1;
     }
-    root_dir.inode_index = (uint16_t)res;
-    assert(root_dir.inode_index == 0);
 
-    struct inode* inode = &inode_table[root_dir.inode_index];
-    inode->type = DIR;
-    inode->file_len = 0;
+    int cached;
+    if (dcache_lookup(dir_index, name, &cached)) {
+        return cached;
+    }
 
-    write_to_file((char*)&root_dir, sizeof(struct dir_entry), root_dir.inode_index);
-    return 0;
+    struct dir_entry entry;
+    uint32_t slot;
+    uint32_t pos;
+    int found = (lookup_entry(dir_index, name, &entry, &slot, &pos) == 0) ? entry.inode_index : -1;
+    dcache_insert(dir_index, name, found);
+    return found;
 }
 
-int dump_info() {
-    lseek(fs_fd, SUPERBLOCK_OFFSET, SEEK_SET);
-    // superblock
-    write(fs_fd, &sb, sizeof(struct superblock));
+void fs_init_cwd(struct fs_cwd* dir) {
+    dir->ref.index = 0;
+    dir->ref.generation = inode_table[0].generation;
+    strcpy(dir->path, "/");
+}
+
+void fs_set_cwd(struct fs_cwd* dir) {
+    cwd = dir;
+}
+
+const char* current_dir() {
+    return (cwd != NULL) ? cwd->path : "/";
+}
+
+static int is_dot(const char* name, size_t len) {
+    return len == 1 && name[0] == '.';
+}
+
+static int is_dot_dot(const char* name, size_t len) {
+    return len == 2 && name[0] == '.' && name[1] == '.';
+}
 
-    write(fs_fd, &block_bitmap[0], sizeof(int) * sb.block_count);
-    write(fs_fd, &inode_bitmap[0], sizeof(int) * sb.inode_count);
-    write(fs_fd, &inode_table[0], sb.inode_size * sb.inode_count);
+static int has_dot_dot(const char* path) {
+    while (*path != '\0') {
+        size_t len = strcspn(path, "/");
+        if (is_dot_dot(path, len)) {
+            return 1;
+        }
+        path += len;
+        path += strspn(path, "/");
+    }
     return 0;
 }
 
-int load_info() {
-    lseek(fs_fd, SUPERBLOCK_OFFSET, SEEK_SET);
-    read(fs_fd, &sb, sizeof(struct superblock));
-    read(fs_fd, &block_bitmap[0], sizeof(int) * sb.block_count);
-    read(fs_fd, &inode_bitmap[0], sizeof(int) * sb.inode_count);
-    read(fs_fd, &inode_table[0], sb.inode_size * sb.inode_count);
+// Append components of path to absolute path in out, "." is skipped and ".."
+// drops the last component. Return -1 if result does not fit into size
+static int append_path(char* out, size_t size, const char* path) {
+    size_t pos = strlen(out);
+    while (*path != '\0') {
+        path += strspn(path, "/");
+        size_t len = strcspn(path, "/");
+        if (len == 0 || is_dot(path, len)) {
+            path += len;
+            continue;
+        }
+        if (is_dot_dot(path, len)) {
+            while (pos > 1 && out[pos - 1] != '/') {
+                --pos;
+            }
+            pos = (pos > 1) ? pos - 1 : 1;
+        } else {
+            size_t sep = (pos > 1) ? 1 : 0;
+            if (pos + sep + len >= size) {
+                return -1;
+            }
+            if (sep) {
+                out[pos++] = '/';
+            }
+            memcpy(out + pos, path, len);
+            pos += len;
+        }
+        out[pos] = '\0';
+        path += len;
+    }
     return 0;
 }
 
-int fs_init(int fs, int client) {
-    fs_fd = fs;
-    client_fd = client;
-    
-    lseek(fs_fd, 0, SEEK_SET);
-    
-    sb.block_count = BLOCK_COUNT;
-    sb.inode_count = INODE_COUNT;
-    sb.free_inode_count = INODE_COUNT;
-    sb.free_block_count = BLOCK_COUNT;
-    sb.block_size = BLOCK_SIZE;
-    sb.inode_size = sizeof(struct inode);
-    sb.magic_number = MAGIC_NUMBER;
+// Absolute path without "." and ".." for path relative to working directory
+static int normalize_path(const char* path, char* out, size_t size) {
+    strcpy(out, "/");
+    if (path[0] != '/' && append_path(out, size, current_dir()) != 0) {
+        return -1;
+    }
+    return append_path(out, size, path);
+}
 
-    int buffer[SUPERBLOCK_OFFSET];
-    memset(buffer, 0, sizeof(buffer));
+// Resolve path holding lock of each directory until its child is locked,
+// so found inode cannot be removed in between. On success the inode stays
+// locked (for writing if write is set). Relative path starts from working
+// directory unless it goes up with "..". Caller holds fs lock
+static int walk_path(const char* path, int write, struct inode_ref* ref) {
+    char normalized[FS_PATH_LEN];
+    if (has_dot_dot(path)) {
+        if (normalize_path(path, normalized, sizeof(normalized)) != 0) {
+            return -1;
+        }
+        path = normalized;
+    }
 
-    lseek(fs_fd, 0, SEEK_SET);
-    write(fs_fd, &buffer[0], sizeof(buffer));
+    int inode_index = 0;  // root inode index
+    uint32_t generation = inode_table[0].generation;
+    if (path[0] != '/' && cwd != NULL) {
+        inode_index = cwd->ref.index;
+        generation = cwd->ref.generation;
+    }
 
-    memset(&block_bitmap[0], 0, sb.block_count * sizeof(int));
-    memset(&inode_bitmap[0], 0, sb.inode_count * sizeof(int));
-    memset(&inode_table[0], 0, sb.inode_size * sb.inode_count);
+    const char* next = path;
+    while (*next == '/') {
+        ++next;
+    }
+    lock_inode(inode_index, write && *next == '\0');
+    if (inode_table[inode_index].generation != generation) {
+        unlock_inode(inode_index);
+        return -1;  // working directory was removed
+    }
 
-    create_root();
+    while (*next != '\0') {
+        char name[NAME_LEN];
+        size_t len = strcspn(next, "/");
+        if (is_dot(next, len)) {
+            next += len;
+            next += strspn(next, "/");
+            if (*next == '\0' && write) {
+                // Directory itself is the target, relock it for writing
+                unlock_inode(inode_index);
+                lock_inode(inode_index, 1);
+                if (inode_table[inode_index].generation != generation) {
+                    unlock_inode(inode_index);
+                    return -1;
+                }
+            }
+            continue;
+        }
 
-    dump_info();
+        int child = -1;
+        if (len < NAME_LEN) {
+            memcpy(name, next, len);
+            name[len] = '\0';
+            child = find_entry(inode_index, name);
+        }
+
+        next += len;
+        while (*next == '/') {
+            ++next;
+        }
+        if (child < 0) {
+            unlock_inode(inode_index);
+            return -1;  // not found
+        }
+
+        lock_inode(child, write && *next == '\0');
+        unlock_inode(inode_index);
+        inode_index = child;
+        generation = inode_table[child].generation;
+    }
+
+    ref->index = inode_index;
+    ref->generation = inode_table[inode_index].generation;
     return 0;
 }
 
-char* read_file(int inode_index) {
-    struct inode* inode = &inode_table[inode_index];
-    char* content = malloc(inode->file_len + 1);
-    char* position = content;
-
-    int remain = inode->file_len;
-    for (int i = 0; remain > 0 && i < ADDR_COUNT; ++i) {
-        int block_index = inode->blocks_addr[i];
+int lookup_file(const char* path, struct inode_ref* ref, struct inode* stat) {
+    lock_fs();
+    if (walk_path(path, 0, ref) != 0) {
+        unlock_fs();
+        return -1;
+    }
+    if (stat != NULL) {
+        *stat = inode_table[ref->index];
+    }
+    unlock_inode(ref->index);
+    unlock_fs();
+    return 0;
+}
 
-        int to_read = (int)((remain < sb.block_size) ? remain : sb.block_size);
+int change_dir(const char* path) {
+    if (cwd == NULL) {
+        fs_fail("cd: no session");
+        return report(-1);
+    }
 
-        lseek(fs_fd, DATA_OFFSET + block_index * sb.block_size, SEEK_SET);
-        read(fs_fd, position, to_read);
+    char target[FS_PATH_LEN];
+    if (normalize_path(path, target, sizeof(target)) != 0) {
+        fs_fail("cd: path is too long");
+        return report(-1);
+    }
 
-        position += to_read;
-        remain -= to_read;
+    // Walk is short for path relative to cached working directory
+    struct inode_ref ref;
+    struct inode stat;
+    if (lookup_file(path, &ref, &stat) != 0) {
+        fs_fail("cd: directory not found");
+        return report(-1);
+    }
+    if (stat.type != DIR) {
+        fs_fail("cd: not a directory");
+        return report(-1);
     }
 
-    content[inode->file_len] = '\0';
-    return content;
+    cwd->ref = ref;
+    strcpy(cwd->path, target);
+    return report(0);
 }
 
 // TODO: make file structure more flexible
-// TODO: implement filesystem traverse by `cd` command
-ssize_t find_file(char* path) {
-    int inode_index = 0;  // root inode index
-    for (char* next = strtok(path, "/"); next != NULL; next = strtok(NULL, "/")) {
-        struct dir_entry* dirs = (struct dir_entry*)read_file(inode_index);
-
-        int dir_count = inode_table[inode_index].file_len / sizeof(struct dir_entry);
-
-        int found = 0;
-        for (int i = 0; i < dir_count; ++i) {
-            if (strcmp(dirs[i].name, next) == 0) {
-                inode_index = dirs[i].inode_index;
-                found = 1;
-            }
-        }
-        free(dirs);
-        if (found) {
-            continue;
-        }
-        return -1;  // not found
-    }
-    return inode_index;
+ssize_t find_file(const char* path) {
+    struct inode_ref ref;
+    return (lookup_file(path, &ref, NULL) == 0) ? ref.index : -1;
 }
 
 int separate_path(const char* path) {
@@ -261,16 +1728,17 @@ int create_at(char* path, int type, char* content) {
     size_t len = strlen(path);
     int sep_index = separate_path(path);
 
-    if (sep_index == -1) {
-        send_failure("create: wrong path", client_fd);
-        return -1;
+    if (sep_index == -1 && path[0] == '/') {
+        fs_fail("create: wrong path");
+        return report(-1);
     }
 
+    // Name without separator is created in working directory
     char basepath[128];
     memset(basepath, 0, sizeof(basepath));
-    if (sep_index != 0) {
+    if (sep_index > 0) {
         strncpy(basepath, path, sep_index);
-    } else {
+    } else if (sep_index == 0) {
         // Start from root
         strcpy(basepath, "/");
     }
@@ -279,56 +1747,106 @@ int create_at(char* path, int type, char* content) {
     memset(name, 0, sizeof(name));
     strncpy(name, path + sep_index + 1, len - (sep_index + 1));
 
-    ssize_t res;
-    if ((res = find_file(basepath)) < 0) {
-        send_failure("create_at: basepath not found", client_fd);
-        return -1;
+    lock_fs();
+    struct inode_ref parent;
+    if (walk_path(basepath, 1, &parent) != 0) {
+        unlock_fs();
+        fs_fail("create_at: basepath not found");
+        return report(-1);
     }
-    int parent_inode = res;
 
+    int result = create_in(parent.index, name, type, content);
+    unlock_inode(parent.index);
+    unlock_fs();
+
+    // Change is reported done only once it is durable
+    if (result == 0 && batch_depth == 0 && dump_info() != 0) {
+        fs_fail("create_at: cannot commit metadata");
+        result = -1;
+    }
+    return report(result);
+}
+
+// Add new inode to directory, caller holds write lock of parent
+static int create_in(int parent_inode, const char* name, int type, char* content) {
     if (inode_table[parent_inode].type != DIR) {
-        send_failure("create_at: not a directory", client_fd);
+        fs_fail("create_at: not a directory");
+        return -1;
+    }
+    if (strlen(name) >= NAME_LEN) {
+        fs_fail("create_at: name is too long");
+        return -1;
+    }
+    if (name[0] == '\0' || is_dot(name, strlen(name)) || is_dot_dot(name, strlen(name))) {
+        fs_fail("create_at: wrong name");
+        return -1;
+    }
+    if (find_entry(parent_inode, name) >= 0) {
+        fs_fail("create_at: file already exists");
         return -1;
     }
 
     // New directory entry (file or other directory)
     struct dir_entry new_entry;
+    memset(&new_entry, 0, sizeof(new_entry));
     strcpy(new_entry.name, name);
+    ssize_t res;
     if ((res = get_free_inode_index()) < 0) {
-        send_failure("create_at: no free inodes", client_fd);
+        fs_fail("create_at: no free inodes");
         return -1;
     }
     new_entry.inode_index = res;
 
+    // Stale references to the previous user of inode may still lock it
+    lock_inode(new_entry.inode_index, 1);
     struct inode* inode = &inode_table[new_entry.inode_index];
     inode->type = type;
+    inode->flags = (type == REG) ? INODE_INLINE : 0;
     inode->file_len = 0;
+    mark_inode_dirty(new_entry.inode_index);
 
-    if (content != NULL) {
-        write_to_file(content, (int)strlen(content), new_entry.inode_index);
+    // Inode is released before any entry points to it, blocks written so far go with it
+    if (content != NULL && write_to_file(content, strlen(content), new_entry.inode_index) != 0) {
+        free_inode(new_entry.inode_index);
+        unlock_inode(new_entry.inode_index);
+        return -1;
     }
+    unlock_inode(new_entry.inode_index);
 
     // Save info about child to parent
-    write_to_file((char*)&new_entry, sizeof(struct dir_entry), parent_inode);
-    dump_info();
+    uint32_t pos = dir_entry_count(parent_inode);
+    if (write_entry(parent_inode, pos, &new_entry) != 0) {
+        lock_inode(new_entry.inode_index, 1);
+        free_inode(new_entry.inode_index);
+        unlock_inode(new_entry.inode_index);
+        return -1;
+    }
+    update_index(parent_inode, name, pos);
+    dcache_insert(parent_inode, new_entry.name, new_entry.inode_index);
     return 0;
 }
 
+// Remove inode and everything inside it, caller holds write lock of inode.
+// Children are locked after their parent, as in path lookup
 int remove_inode(int inode_index) {
     struct inode* inode = &inode_table[inode_index];
 
     if (inode->type == DIR) {
-        struct dir_entry* dirs = (struct dir_entry*)read_file(inode_index);
+        struct dir_entry* dirs = (struct dir_entry*)load_file(inode_index);
         int dir_count = inode->file_len / sizeof(struct dir_entry);
 
         for (int i = 0; i < dir_count; ++i) {
+            lock_inode(dirs[i].inode_index, 1);
             remove_inode(dirs[i].inode_index);
+            unlock_inode(dirs[i].inode_index);
         }
 
         free(dirs);
+        drop_index(inode_index);
     }
 
     free_inode(inode_index);
+    dcache_invalidate_inode(inode_index);
     return 0;
 }
 
@@ -336,74 +1854,108 @@ int remove_at(char* path) {
     size_t len = strlen(path);
     int sep_index = separate_path(path);
 
-    if (sep_index == -1) {
-        send_failure("create: wrong path", client_fd);
-        return -1;
+    if (sep_index == -1 && path[0] == '/') {
+        fs_fail("create: wrong path");
+        return report(-1);
     }
 
     char basepath[128];
     memset(basepath, 0, sizeof(basepath));
-    strncpy(basepath, path, sep_index);
+    if (sep_index > 0) {
+        strncpy(basepath, path, sep_index);
+    } else if (sep_index == 0) {
+        strcpy(basepath, "/");
+    }
 
     char name[128];
     memset(name, 0, sizeof(name));
     strncpy(name, path + sep_index + 1, len - (sep_index + 1));
 
-    ssize_t res;
-    if ((res = find_file(basepath)) < 0) {
-        send_failure("mkdir: basepath not found", client_fd);
-        return -1;
+    lock_fs();
+    struct inode_ref parent;
+    if (walk_path(basepath, 1, &parent) != 0) {
+        unlock_fs();
+        fs_fail("mkdir: basepath not found");
+        return report(-1);
     }
-    int parent_inode = res;
 
-    struct inode* parent = &inode_table[parent_inode];
+    int result = remove_from(parent.index, name);
+    unlock_inode(parent.index);
+    unlock_fs();
 
-    if (parent->type != DIR) {
-        send_failure("remove: basepath is not a directory", client_fd);
-        return -1;
+    // Change is reported done only once it is durable
+    if (result == 0 && batch_depth == 0 && dump_info() != 0) {
+        fs_fail("remove: cannot commit metadata");
+        result = -1;
     }
+    return report(result);
+}
 
-    struct dir_entry* dirs = (struct dir_entry*)read_file(parent_inode);
-    int dir_count = parent->file_len / sizeof(struct dir_entry);
+// Move the last entry of directory to pos and release its place, so
+// directory stays dense and only two entries are written. Slot of the
+// moved entry is fixed, slots of other entries stay valid. Last slot is
+// kept if the move fails, so no live entry is cut off
+static int move_last_entry(int dir_index, uint32_t pos) {
+    uint32_t last = dir_entry_count(dir_index) - 1;
+    if (pos != last) {
+        struct dir_entry moved;
+        if (read_entry(dir_index, last, &moved) != 0 || write_entry(dir_index, pos, &moved) != 0) {
+            return -1;
+        }
 
-    uint16_t inode_remove;
-    int index = -1;
-    for (int i = 0; i < dir_count; ++i) {
-        if (strcmp(dirs[i].name, name) == 0) {
-            inode_remove = dirs[i].inode_index;
-            index = i;
-            break;
+        if (inode_table[dir_index].index_inode != 0) {
+            struct dir_entry entry;
+            uint32_t slot;
+            uint32_t moved_pos;
+            if (index_find(dir_index, moved.name, &entry, &slot, &moved_pos) != 0 ||
+                moved_pos != last ||
+                index_set(dir_index, slot, name_hash(moved.name), pos + 1) != 0) {
+                drop_index(dir_index);  // index is inconsistent
+            }
         }
     }
-    if (index == -1) {
-        send_failure("remove: file not found", client_fd);
-        return -1;
-    }
 
-    // Remove from parent list of records
-    uint32_t new_len = parent->file_len - sizeof(struct dir_entry);
+    // Block is released once its last entry is gone
+    cut_file(dir_index, (uint64_t)last * sizeof(struct dir_entry));
+    return 0;
+}
 
-    memmove(&dirs[index], &dirs[index + 1],
-            parent->file_len - (index + 1) * sizeof(struct dir_entry));
-    memset(&dirs[dir_count - 1], 0, sizeof(struct dir_entry));
+// Remove entry with name from directory, caller holds write lock of parent
+static int remove_from(int parent_inode, const char* name) {
+    struct inode* parent = &inode_table[parent_inode];
 
-    int pos_in_block = parent->file_len % sb.block_size;
-    if (pos_in_block < sizeof(struct dir_entry)) {
-        int addr_index = parent->file_len / sb.block_size;
-        int block_index = parent->blocks_addr[addr_index];
-        free_block(block_index);
+    if (parent->type != DIR) {
+        fs_fail("remove: basepath is not a directory");
+        return -1;
     }
-    parent->file_len = 0;  // Write from beginning
-    write_to_file((char*)dirs, new_len, parent_inode);
-    parent->file_len = new_len;
-    free(dirs);
 
-    // Remove inode
-    if (remove_inode(inode_remove) != 0) {
-        send_failure("remove: failed to remove inode", client_fd);
+    struct dir_entry entry;
+    uint32_t slot;
+    uint32_t pos;
+    if (lookup_entry(parent_inode, name, &entry, &slot, &pos) != 0) {
+        fs_fail("remove: file not found");
         return -1;
     }
+    // Stale slot would point at entry moved into its place
+    if (parent->index_inode != 0 && index_set(parent_inode, slot, 0, SLOT_DELETED) != 0) {
+        drop_index(parent_inode);
+    }
+    if (move_last_entry(parent_inode, pos) != 0) {
+        drop_index(parent_inode);  // deleted slot would hide the entry
+        fs_fail("remove: cannot update directory");
+        return -1;
+    }
+    dcache_remove(parent_inode, name);
+
+    int inode_remove = entry.inode_index;
 
-    dump_info();
+    // Remove inode
+    lock_inode(inode_remove, 1);
+    int result = remove_inode(inode_remove);
+    unlock_inode(inode_remove);
+    if (result != 0) {
+        fs_fail("remove: failed to remove inode");
+        return -1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "server/journal.h"
+
+static struct storage* storage;
+static off_t journal_offset;
+static size_t journal_size;
+
+// Transaction is assembled in buffer: header and records, payload is kept
+// separately and copied after records right before commit
+static char* buffer;
+static char* payload;
+static uint32_t record_count;
+static size_t payload_len;
+
+static uint64_t sequence;
+static struct journal_stats stats;
+
+static struct journal_header* header() {
+    return (struct journal_header*)buffer;
+}
+
+static struct journal_record* records() {
+    return (struct journal_record*)(buffer + sizeof(struct journal_header));
+}
+
+static size_t records_end(uint32_t count) {
+    return sizeof(struct journal_header) + (size_t)count * sizeof(struct journal_record);
+}
+
+// FNV-1a
+static uint64_t checksum(const char* data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int journal_init(struct storage* disk, off_t offset, size_t size) {
+    journal_free();
+
+    storage = disk;
+    journal_offset = offset;
+    journal_size = size;
+    sequence = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    if (size == 0) {
+        return 0;
+    }
+    if (size < records_end(1)) {
+        return -1;
+    }
+
+    buffer = malloc(size);
+    payload = malloc(size);
+    if (buffer == NULL || payload == NULL) {
+        journal_free();
+        return -1;
+    }
+    journal_begin();
+    return 0;
+}
+
+void journal_free() {
+    free(buffer);
+    free(payload);
+    buffer = NULL;
+    payload = NULL;
+    journal_size = 0;
+}
+
+void journal_begin() {
+    record_count = 0;
+    payload_len = 0;
+}
+
+int journal_add(off_t offset, const void* data, size_t len) {
+    __atomic_add_fetch(&stats.records, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.bytes, len, __ATOMIC_RELAXED);
+
+    if (journal_size == 0) {
+        return storage_write(storage, data, len, offset) < 0 ? -1 : 0;
+    }
+
+    if (records_end(record_count + 1) + payload_len + len > journal_size) {
+        return -1;
+    }
+
+    struct journal_record* record = &records()[record_count++];
+    record->offset = (uint64_t)offset;
+    record->len = (uint32_t)len;
+    record->reserved = 0;
+
+    memcpy(payload + payload_len, data, len);
+    payload_len += len;
+    return 0;
+}
+
+// Write records of transaction in buffer to their places on disk
+static int apply(const struct journal_record* tx_records, uint32_t count, const char* tx_payload) {
+    size_t position = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (storage_write(storage, tx_payload + position, tx_records[i].len,
+                          (off_t)tx_records[i].offset) < 0) {
+            return -1;
+        }
+        position += tx_records[i].len;
+    }
+    return storage_sync(storage);
+}
+
+static int clear_header() {
+    struct journal_header empty;
+    memset(&empty, 0, sizeof(empty));
+    return storage_write(storage, &empty, sizeof(empty), journal_offset) < 0 ? -1 : 0;
+}
+
+int journal_commit() {
+    if (journal_size == 0) {
+        __atomic_add_fetch(&stats.commits, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (record_count == 0) {
+        return 0;
+    }
+
+    size_t tx_len = records_end(record_count) + payload_len;
+    memcpy(buffer + records_end(record_count), payload, payload_len);
+
+    struct journal_header* tx = header();
+    tx->magic = JOURNAL_MAGIC;
+    tx->sequence = ++sequence;
+    tx->record_count = record_count;
+    tx->reserved = 0;
+    tx->payload_len = payload_len;
+    tx->checksum = checksum(buffer + sizeof(struct journal_header),
+                            tx_len - sizeof(struct journal_header));
+
+    // Transaction is durable after the first sync, records are applied after it
+    if (storage_write(storage, buffer, tx_len, journal_offset) < 0 ||
+        storage_sync(storage) != 0) {
+        return -1;
+    }
+    if (apply(records(), record_count, payload) != 0) {
+        return -1;
+    }
+    // Cleared header reaches disk with the next sync, replaying the same
+    // transaction again is harmless
+    clear_header();
+
+    __atomic_add_fetch(&stats.commits, 1, __ATOMIC_RELAXED);
+    journal_begin();
+    return 0;
+}
+
+int journal_replay() {
+    if (journal_size == 0) {
+        return 0;
+    }
+
+    struct journal_header tx;
+    if (storage_read(storage, &tx, sizeof(tx), journal_offset) < 0) {
+        return -1;
+    }
+    if (tx.magic != JOURNAL_MAGIC) {
+        return 0;  // clean shutdown
+    }
+
+    sequence = tx.sequence;
+    if (records_end(tx.record_count) + tx.payload_len > journal_size) {
+        return clear_header();
+    }
+
+    size_t tx_len = records_end(tx.record_count) + tx.payload_len;
+    if (storage_read(storage, buffer, tx_len, journal_offset) < 0) {
+        return -1;
+    }
+    if (checksum(buffer + sizeof(struct journal_header),
+                 tx_len - sizeof(struct journal_header)) != tx.checksum) {
+        // Transaction was not completely written, its changes never reached their places
+        return clear_header();
+    }
+
+    if (apply(records(), tx.record_count, buffer + records_end(tx.record_count)) != 0) {
+        return -1;
+    }
+    if (clear_header() != 0) {
+        return -1;
+    }
+    return storage_sync(storage);
+}
+
+// Counters are read by stats dump while commits run
+struct journal_stats journal_get_stats() {
+    struct journal_stats result;
+    result.commits = __atomic_load_n(&stats.commits, __ATOMIC_RELAXED);
+    result.records = __atomic_load_n(&stats.records, __ATOMIC_RELAXED);
+    result.bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+    return result;
+}
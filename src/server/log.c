@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "server/log.h"
+
+#define LOG_IDLE_NS 10000000  // writer sleeps 10 ms when ring is empty
+
+// Slot of the ring. Sequence tells who owns it: it equals position of the
+// next producer that may fill it, and position + 1 once message is ready
+// for writer (bounded queue of D. Vyukov with a single consumer)
+struct log_slot {
+    uint64_t sequence;
+    enum log_level level;
+    struct timespec time;
+    char text[LOG_LINE_LEN];
+};
+
+static const char* const level_names[] = {
+    [LOG_DEBUG] = "debug", [LOG_INFO] = "info", [LOG_WARN] = "warn", [LOG_ERROR] = "error"};
+
+static struct log_slot* slots;
+static uint64_t tail;  // next position to fill, shared by producers
+static uint64_t head;  // next position to write, owned by writer thread
+static uint64_t dropped;
+static enum log_level min_level = LOG_INFO;
+
+static FILE* log_file;
+static int stopping;
+static int started;
+static pthread_t thread;
+
+int log_parse_level(const char* name, enum log_level* level) {
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; ++i) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *level = (enum log_level)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void write_slot(const struct log_slot* slot) {
+    struct tm local;
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&slot->time.tv_sec, &local));
+    fprintf(log_file, "%s.%03ld %s %s\n", stamp, slot->time.tv_nsec / 1000000,
+            level_names[slot->level], slot->text);
+}
+
+// Write ready messages in order, return number of written ones
+static size_t drain() {
+    size_t written = 0;
+    while (1) {
+        struct log_slot* slot = &slots[head & (LOG_CAPACITY - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != head + 1) {
+            break;
+        }
+        write_slot(slot);
+        // Slot is free for the producer one lap later
+        __atomic_store_n(&slot->sequence, head + LOG_CAPACITY, __ATOMIC_RELEASE);
+        ++head;
+        ++written;
+    }
+    return written;
+}
+
+// One flush per batch of messages instead of one per message
+static void* writer_thread(void* arg) {
+    (void)arg;
+    uint64_t reported_drops = 0;
+    while (1) {
+        size_t written = drain();
+        uint64_t drops = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+        if (drops != reported_drops) {
+            fprintf(log_file, "log: %llu messages dropped, ring is full\n",
+                    (unsigned long long)(drops - reported_drops));
+            reported_drops = drops;
+        }
+        if (written > 0) {
+            fflush(log_file);
+            continue;
+        }
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        struct timespec idle = {.tv_sec = 0, .tv_nsec = LOG_IDLE_NS};
+        nanosleep(&idle, NULL);
+    }
+    fflush(log_file);
+    return NULL;
+}
+
+static void release() {
+    if (log_file != NULL) {
+        fclose(log_file);
+        log_file = NULL;
+    }
+    free(slots);
+    slots = NULL;
+}
+
+int log_init(const char* path, enum log_level level) {
+    log_file = fopen(path, "a");
+    slots = calloc(LOG_CAPACITY, sizeof(struct log_slot));
+    if (log_file == NULL || slots == NULL) {
+        release();
+        return -1;
+    }
+    for (uint64_t i = 0; i < LOG_CAPACITY; ++i) {
+        slots[i].sequence = i;
+    }
+    min_level = level;
+    if (pthread_create(&thread, NULL, writer_thread, NULL) != 0) {
+        release();
+        return -1;
+    }
+    __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+    atexit(log_free);
+    return 0;
+}
+
+void log_write(enum log_level level, const char* format, ...) {
+    if (level < min_level) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        va_end(args);
+        return;
+    }
+
+    // Claim position whose slot was released by writer, fail if ring is full
+    uint64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    struct log_slot* slot;
+    while (1) {
+        slot = &slots[pos & (LOG_CAPACITY - 1)];
+        uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(sequence - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            va_end(args);
+            return;
+        } else {
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->level = level;
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t log_dropped() {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+// Ring is not freed: other threads may still be filling slots at exit,
+// their messages are lost then
+void log_free() {
+    if (!__atomic_exchange_n(&started, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    fclose(log_file);
+}
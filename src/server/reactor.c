@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "server/reactor.h"
+
+#define MAX_EVENTS 64
+// Sockets are blocking inside a request, so a client stalled in the middle of
+// one holds its worker until the timeout. It is kept short for that reason
+#define IO_TIMEOUT_SEC 3
+#define REQUESTS_PER_TURN 32  // other clients are not starved by pipelining one
+
+static int epoll_fd = -1;
+static request_handler handle_request;
+static size_t max_clients;
+
+// Sessions with pending requests. Every session is armed with EPOLLONESHOT,
+// so it is queued at most once and queue of max_clients never overflows
+static struct session** queue;
+static size_t queue_head;
+static size_t queue_len;
+static size_t client_count;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+// Workers are joined on stop, so filesystem is not shut down under them
+static pthread_t* workers;
+static size_t worker_count;
+static int stopping;
+
+// Descriptor kept open to accept and drop connections when out of descriptors
+static int reserve_fd = -1;
+
+static void push(struct session* session) {
+    pthread_mutex_lock(&queue_lock);
+    queue[(queue_head + queue_len) % max_clients] = session;
+    ++queue_len;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// Return NULL once reactor is stopping
+static struct session* pop() {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len == 0 && !stopping) {
+        pthread_cond_wait(&queue_ready, &queue_lock);
+    }
+    if (stopping) {
+        pthread_mutex_unlock(&queue_lock);
+        return NULL;
+    }
+    struct session* session = queue[queue_head];
+    queue_head = (queue_head + 1) % max_clients;
+    --queue_len;
+    pthread_mutex_unlock(&queue_lock);
+    return session;
+}
+
+static int arm(struct session* session, int op) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = session;
+    return epoll_ctl(epoll_fd, op, session->fd, &event);
+}
+
+static int reserve_client() {
+    pthread_mutex_lock(&queue_lock);
+    int accepted = client_count < max_clients;
+    if (accepted) {
+        ++client_count;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return accepted;
+}
+
+static void release_client() {
+    pthread_mutex_lock(&queue_lock);
+    --client_count;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void close_session(struct session* session) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+    close(session->fd);
+    free(session);
+    release_client();
+}
+
+// Next pipelined request is already received
+static int has_input(int fd) {
+    char byte;
+    return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+static void* worker(void* arg) {
+    (void)arg;
+    struct session* session;
+    while ((session = pop()) != NULL) {
+        // Connection is watched again only after its requests are handled, so
+        // requests of one client are never processed concurrently and answered in order
+        int result = handle_request(session);
+        for (int served = 1; result == 0 && served < REQUESTS_PER_TURN && has_input(session->fd);
+             ++served) {
+            result = handle_request(session);
+        }
+        if (result != 0 || arm(session, EPOLL_CTL_MOD) != 0) {
+            close_session(session);
+        }
+    }
+    return NULL;
+}
+
+// Accept all pending connections of non-blocking listening socket
+static void accept_clients(int listen_fd) {
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && reserve_fd >= 0) {
+                // Drop connection instead of spinning on it
+                close(reserve_fd);
+                close(accept(listen_fd, NULL, NULL));
+                reserve_fd = open("/dev/null", O_RDONLY);
+                continue;
+            }
+            return;  // EAGAIN: no more pending connections
+        }
+
+        if (!reserve_client()) {
+            close(fd);
+            continue;
+        }
+
+        struct session* session = calloc(1, sizeof(struct session));
+        if (session == NULL) {
+            close(fd);
+            release_client();
+            continue;
+        }
+        session->fd = fd;
+
+        struct timeval timeout = {.tv_sec = IO_TIMEOUT_SEC, .tv_usec = 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        // Answer is written in several small sends (header, status, message), with Nagle
+        // each one after the first waits for delayed ACK of the client
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+        if (arm(session, EPOLL_CTL_ADD) != 0) {
+            close(fd);
+            free(session);
+            release_client();
+        }
+    }
+}
+
+int reactor_run(int listen_fd, const struct reactor_config* config, request_handler handler) {
+    handle_request = handler;
+    max_clients = config->max_clients;
+
+    queue = malloc(max_clients * sizeof(struct session*));
+    epoll_fd = epoll_create1(0);
+    if (queue == NULL || epoll_fd < 0) {
+        perror("reactor init");
+        return -1;
+    }
+    reserve_fd = open("/dev/null", O_RDONLY);
+
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;  // listening socket
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+        perror("reactor listen");
+        return -1;
+    }
+
+    workers = malloc(config->workers * sizeof(pthread_t));
+    if (workers == NULL) {
+        perror("reactor init");
+        return -1;
+    }
+    // Stop waits for every worker started before it
+    pthread_mutex_lock(&queue_lock);
+    for (size_t i = 0; i < config->workers && !stopping; ++i) {
+        if (pthread_create(&workers[worker_count], NULL, worker, NULL) != 0) {
+            pthread_mutex_unlock(&queue_lock);
+            perror("reactor worker");
+            return -1;
+        }
+        ++worker_count;
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return -1;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == NULL) {
+                accept_clients(listen_fd);
+            } else {
+                push((struct session*)events[i].data.ptr);
+            }
+        }
+    }
+}
+
+void reactor_stop() {
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_ready);
+    size_t count = worker_count;
+    pthread_mutex_unlock(&queue_lock);
+
+    for (size_t i = 0; i < count; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+size_t reactor_client_count() {
+    pthread_mutex_lock(&queue_lock);
+    size_t count = client_count;
+    pthread_mutex_unlock(&queue_lock);
+    return count;
+}
@@ -1,24 +1,27 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "server/adapter.h"
+#include "server/cache.h"
+#include "server/discard.h"
+#include "server/log.h"
+#include "server/reactor.h"
+#include "server/stats.h"
 
-int disk_fd;
+struct storage disk;
 _Thread_local int client_fd;
 _Thread_local int user_id;
 
-FILE* log_fp;
-
-void write_to_log(const char* msg) {
-    fprintf(log_fp, "%s\n", msg);
-    fflush(log_fp);
-}
+#define DEFAULT_STATS_INTERVAL 60  // seconds between stats written to log
 
 void daemonize() {
     pid_t pid;
@@ -45,26 +48,103 @@ void daemonize() {
     umask(0);
 }
 
-void create_disk(const char* path) {
-    disk_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (disk_fd == -1) {
-        write_to_log("cannot create disk by path to character device");
+void create_disk(const char* path, enum storage_kind kind, size_t cache_blocks, int format) {
+    if (storage_open(&disk, path, kind, DEFAULT_DISK_SIZE) == -1) {
+        log_write(LOG_ERROR, "cannot open disk by path to character device or image file");
         exit(1);
     }
     
-    // TODO: use perform_open to restore filesystem from previous session
-    perform_init(disk_fd, client_fd);
+    // Filesystem from previous session is restored unless format is requested
+    if (perform_init(&disk, client_fd, cache_blocks, format) != 0) {
+        log_write(LOG_ERROR, "cannot initialize filesystem");
+        exit(1);
+    }
+}
+
+// Histograms of all threads since start with cache and journal counters
+void log_stats() {
+    struct stats total;
+    stats_collect(&total);
+    size_t len = format_stats(&total, NULL, 0);
+    char* text = malloc(len + 1);
+    if (text == NULL) {
+        return;
+    }
+    format_stats(&total, text, len + 1);
+
+    // Every line is a separate message, so it fits into a log slot
+    char* save = NULL;
+    for (char* line = strtok_r(text, "\n", &save); line != NULL;
+         line = strtok_r(NULL, "\n", &save)) {
+        log_write(LOG_INFO, "stats: %s", line);
+    }
+    free(text);
+}
+
+void* dump_stats(void* interval) {
+    unsigned int seconds = *(unsigned int*)interval;
+    while (1) {
+        sleep(seconds);
+        log_stats();
+    }
+    return NULL;
 }
 
-int setup_server(int port) {
+// Stats are written to log every interval seconds, 0 disables it
+void setup_stats_dump(unsigned int* interval) {
+    if (*interval == 0) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dump_stats, interval) == 0) {
+        pthread_detach(thread);
+    }
+}
+
+// Signals are blocked in all threads and handled here synchronously,
+// so cached blocks can be safely written back before exit
+void* wait_shutdown(void* signals) {
+    int signal;
+    sigwait((sigset_t*)signals, &signal);
+
+    // No request is in progress when filesystem is freed
+    reactor_stop();
+    log_stats();
+    perform_shutdown();
+    storage_close(&disk);
+    log_write(LOG_INFO, "server stopped");
+    exit(0);
+}
+
+static sigset_t shutdown_signals;
+
+// Called before any thread is started: threads inherit the mask, and one
+// that does not block the signals would be killed by them
+void block_signals() {
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+
+    // Client may disconnect in the middle of response
+    signal(SIGPIPE, SIG_IGN);
+}
+
+void setup_signals() {
+    pthread_t thread;
+    pthread_create(&thread, NULL, wait_shutdown, &shutdown_signals);
+    pthread_detach(thread);
+}
+
+int setup_server(int port, int backlog) {
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_fd < 0) {
-        write_to_log("cannot create socket");
+        log_write(LOG_ERROR, "cannot create socket");
         exit(1);
     }
     
     if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
-        write_to_log("setsockopt error");
+        log_write(LOG_WARN, "setsockopt error");
     }
     
     struct sockaddr_in serv_addr;
@@ -73,79 +153,184 @@ int setup_server(int port) {
     serv_addr.sin_addr.s_addr = INADDR_ANY;
     
     if (bind(sock_fd, (struct sockaddr*)(&serv_addr), sizeof(serv_addr)) < 0) {
-        write_to_log("bind error");
+        log_write(LOG_ERROR, "bind error");
         exit(1);
     }
     
-    listen(sock_fd, 1);
+    if (listen(sock_fd, backlog) < 0) {
+        log_write(LOG_ERROR, "listen error");
+        exit(1);
+    }
     return sock_fd;
 }
 
-int recv_tokens(struct tokenizer* tokenizer) {
-    char line[1024];
-    memset(line, 0, sizeof(line));
-    
-    safe_recv(line, client_fd);
-    tokenizer_init(tokenizer, line);
-    return (int)tokenizer->token_count;
-}
+typedef int (*command_handler)(const struct request* request, int client_fd);
 
-void* process_client(void* new_client_fd) {
-    client_fd = *((int*)(new_client_fd));
-    free((int*)new_client_fd);
+// Response to client is sent in `perform_` commands
+static const command_handler handlers[OP_COUNT] = {
+    [OP_TOUCH] = perform_touch, [OP_MKDIR] = perform_mkdir, [OP_RM] = perform_rm,
+    [OP_RMDIR] = perform_rmdir, [OP_CAT] = perform_cat,     [OP_LS] = perform_ls,
+    [OP_PUT] = perform_put,     [OP_GET] = perform_get,     [OP_BATCH] = perform_batch,
+    [OP_READ] = perform_read,   [OP_WRITE] = perform_write, [OP_CD] = perform_cd,
+    [OP_PWD] = perform_pwd,     [OP_OPEN] = perform_open,   [OP_CLOSE] = perform_close,
+    [OP_STATS] = perform_stats,
+};
 
-    char user_id_str[1024];
-    memset(user_id_str, 0, sizeof(user_id_str));
-    safe_recv(user_id_str, client_fd);
-    
-    user_id = (int)strtol(user_id_str, 0, 10);
-    send_status(1, client_fd);
-    
-    struct tokenizer tokenizer;
-    
-    while (recv_tokens(&tokenizer) > 0) {
-        size_t len = tokenizer.head->len;
-        char* first = tokenizer.head->start;
-        
-        // Response to client is sent in `perform_` commands
-        if (strncmp(first, "quit", len) == 0) {
-            tokenizer_free(&tokenizer);
-            break;
-        } else if (strncmp(first, "touch", len) == 0) {
-            perform_touch(tokenizer, client_fd);
-        } else if (strncmp(first, "mkdir", len) == 0) {
-            perform_mkdir(tokenizer, client_fd);
-        } else if (strncmp(first, "cat", len) == 0) {
-            perform_cat(tokenizer, client_fd);
-        } else if (strncmp(first, "ls", len) == 0) {
-            perform_ls(tokenizer, client_fd);
-        } else if (strncmp(first, "rm", len) == 0) {
-            perform_rm(tokenizer, client_fd);
-        } else if (strncmp(first, "rmdir", len) == 0) {
-            perform_rmdir(tokenizer, client_fd);
-        } else if (strncmp(first, "put", len) == 0) {
-            perform_put(tokenizer, client_fd);
-        } else if (strncmp(first, "get", len) == 0) {
-            perform_get(tokenizer, client_fd);
+// Called by worker when client connection is readable, handles one request
+int process_request(struct session* session) {
+    client_fd = session->fd;
+
+    if (!session->greeted) {
+        char user_id_str[1024];
+        memset(user_id_str, 0, sizeof(user_id_str));
+        safe_recv(user_id_str, client_fd);
+        if (user_id_str[0] == '\0') {
+            return -1;  // connection is closed
         }
-        
-        tokenizer_free(&tokenizer);
+
+        session->user_id = (int)strtol(user_id_str, 0, 10);
+        session->greeted = 1;
+        fs_init_cwd(&session->cwd);
+        send_status(1, client_fd);
+        return 0;
     }
-    return NULL;
+    user_id = session->user_id;
+    fs_set_cwd(&session->cwd);
+    perform_set_handles(&session->handles);
+
+    // Parsed in place, arguments point into request
+    struct request request;
+    if (recv_request(client_fd, &request) != 0) {
+        return -1;  // connection is closed or stream is broken
+    }
+    if (request.opcode == OP_QUIT) {
+        return -1;
+    }
+
+    if (send_response_header(client_fd, &request) != 0) {
+        return -1;
+    }
+    if (handlers[request.opcode] == NULL) {
+        send_failure("unknown command", client_fd);
+        return 0;
+    }
+    // Time from parsed request to sent answer
+    uint64_t start = stats_now();
+    handlers[request.opcode](&request, client_fd);
+    stats_record_request(request.opcode, start);
+    log_write(LOG_DEBUG, "user %d: %s %s", user_id, opcode_name(request.opcode),
+              (request.arg_count > 0) ? request.args[0] : "");
+    return 0;
+}
+
+// Every client needs a descriptor, so soft limit is raised up to hard one
+void raise_fd_limit(size_t max_clients) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return;
+    }
+    rlim_t wanted = (rlim_t)max_clients + 64;
+    if (limit.rlim_cur < wanted) {
+        limit.rlim_cur = (limit.rlim_max < wanted) ? limit.rlim_max : wanted;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void print_usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-f] [-F] [-d disk] [-s pio|mmap] [-c cache blocks] "
+            "[-z sync|deferred|lazy] [-w workers] [-b backlog] [-m max clients] "
+            "[-S stats interval] [-l debug|info|warn|error] [port = 8080]\n", name);
 }
 
-// TODO: test working with multiple clients
 int main(int argc, char** argv) {
-    daemonize();
-    log_fp = fopen("log.txt", "a");
-    create_disk("/dev/minifs");
-    int sock_fd = setup_server(argc >= 2 ? (int)strtol(argv[1], 0, 10) : 8080);
-    while (1) {
-        int* new_client_fd = malloc(sizeof(int));
-        *new_client_fd = accept(sock_fd, NULL, NULL);
-        pthread_t thread;
-        pthread_create(&thread, NULL, process_client, new_client_fd);
+    const char* disk_path = "/dev/minifs";
+    enum storage_kind kind = STORAGE_PIO;
+    size_t cache_blocks = DEFAULT_CACHE_BLOCKS;
+    enum discard_mode discard_mode = DISCARD_DEFERRED;
+    int foreground = 0;
+    int format = 0;
+    int backlog = SOMAXCONN;
+    enum log_level log_level = LOG_INFO;
+    static unsigned int stats_interval = DEFAULT_STATS_INTERVAL;
+    struct reactor_config config = {.workers = DEFAULT_WORKERS, .max_clients = DEFAULT_MAX_CLIENTS};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "fFd:s:c:z:w:b:m:S:l:")) != -1) {
+        switch (opt) {
+            case 'f':
+                foreground = 1;
+                break;
+            case 'F':
+                format = 1;
+                break;
+            case 'd':
+                disk_path = optarg;
+                break;
+            case 's':
+                if (storage_parse_kind(optarg, &kind) != 0) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                cache_blocks = (size_t)strtoul(optarg, 0, 10);
+                break;
+            case 'z':
+                if (discard_parse_mode(optarg, &discard_mode) != 0) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                config.workers = (size_t)strtoul(optarg, 0, 10);
+                break;
+            case 'b':
+                backlog = (int)strtol(optarg, 0, 10);
+                break;
+            case 'm':
+                config.max_clients = (size_t)strtoul(optarg, 0, 10);
+                break;
+            case 'S':
+                stats_interval = (unsigned int)strtoul(optarg, 0, 10);
+                break;
+            case 'l':
+                if (log_parse_level(optarg, &log_level) != 0) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(1);
+        }
     }
-    close(disk_fd);
-    return 0;
+    int port = optind < argc ? (int)strtol(argv[optind], 0, 10) : 8080;
+    if (config.workers == 0 || config.max_clients == 0 || backlog <= 0 ||
+        cache_blocks < MIN_CACHE_BLOCKS) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    if (!foreground) {
+        daemonize();
+    }
+    block_signals();
+    // Writer thread is started after fork of daemonize
+    if (log_init("log.txt", log_level) != 0) {
+        exit(1);
+    }
+    discard_set_mode(discard_mode);
+    create_disk(disk_path, kind, cache_blocks, format);
+    setup_signals();
+    setup_stats_dump(&stats_interval);
+    raise_fd_limit(config.max_clients);
+    int sock_fd = setup_server(port, backlog);
+
+    // Returns only on error
+    reactor_run(sock_fd, &config, process_request);
+    log_write(LOG_ERROR, "event loop failed");
+    reactor_stop();
+    perform_shutdown();
+    storage_close(&disk);
+    return 1;
 }
\ No newline at end of file
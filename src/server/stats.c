@@ -0,0 +1,169 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "server/stats.h"
+
+struct shard {
+    struct stats stats;
+    struct shard* next;
+};
+
+static const char* const event_names[STATS_EVENT_COUNT] = {
+    [STATS_DEVICE_READ] = "device read", [STATS_DEVICE_WRITE] = "device write",
+    [STATS_BLOCK_ALLOC] = "block alloc", [STATS_BLOCK_FREE] = "block free",
+    [STATS_INODE_ALLOC] = "inode alloc", [STATS_INODE_FREE] = "inode free",
+    [STATS_FLUSH] = "flush",
+};
+
+static const char* const event_units[STATS_EVENT_COUNT] = {
+    [STATS_DEVICE_READ] = "bytes",  [STATS_DEVICE_WRITE] = "bytes",
+    [STATS_BLOCK_ALLOC] = "blocks", [STATS_BLOCK_FREE] = "blocks",
+};
+
+// Shards of all threads that recorded anything, they live until exit
+static struct shard* shards;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct shard* own_shard;
+
+static struct stats* own_stats() {
+    if (own_shard == NULL) {
+        struct shard* shard = calloc(1, sizeof(struct shard));
+        if (shard == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&shards_lock);
+        shard->next = shards;
+        shards = shard;
+        pthread_mutex_unlock(&shards_lock);
+        own_shard = shard;
+    }
+    return &own_shard->stats;
+}
+
+// Only owner thread writes counter, so plain load and store are enough;
+// atomic access keeps concurrent readers from seeing torn values
+static void add(uint64_t* counter, uint64_t value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                     __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void record(struct histogram* histogram, uint64_t start, uint64_t units) {
+    uint64_t ns = stats_now() - start;
+    size_t bucket = (ns == 0) ? 0 : (size_t)(64 - __builtin_clzll(ns));
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+    add(&histogram->count, 1);
+    add(&histogram->units, units);
+    add(&histogram->total_ns, ns);
+    add(&histogram->buckets[bucket], 1);
+    if (ns > load(&histogram->max_ns)) {
+        __atomic_store_n(&histogram->max_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void stats_record(enum stats_event event, uint64_t start, uint64_t units) {
+    struct stats* stats = own_stats();
+    if (stats != NULL) {
+        record(&stats->events[event], start, units);
+    }
+}
+
+void stats_record_request(enum opcode opcode, uint64_t start) {
+    struct stats* stats = own_stats();
+    if (stats != NULL && opcode < OP_COUNT) {
+        record(&stats->requests[opcode], start, 0);
+    }
+}
+
+static void merge(struct histogram* total, const struct histogram* part) {
+    total->count += load(&part->count);
+    total->units += load(&part->units);
+    total->total_ns += load(&part->total_ns);
+    uint64_t max_ns = load(&part->max_ns);
+    total->max_ns = (max_ns > total->max_ns) ? max_ns : total->max_ns;
+    for (size_t i = 0; i < STATS_BUCKETS; ++i) {
+        total->buckets[i] += load(&part->buckets[i]);
+    }
+}
+
+void stats_collect(struct stats* total) {
+    memset(total, 0, sizeof(struct stats));
+    pthread_mutex_lock(&shards_lock);
+    for (struct shard* shard = shards; shard != NULL; shard = shard->next) {
+        for (size_t op = 0; op < OP_COUNT; ++op) {
+            merge(&total->requests[op], &shard->stats.requests[op]);
+        }
+        for (size_t event = 0; event < STATS_EVENT_COUNT; ++event) {
+            merge(&total->events[event], &shard->stats.events[event]);
+        }
+    }
+    pthread_mutex_unlock(&shards_lock);
+}
+
+// Upper bound of bucket holding fraction of values, in microseconds
+static double percentile_us(const struct histogram* histogram, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->count + 0.999999);
+    uint64_t seen = 0;
+    size_t bucket = 0;
+    while (bucket + 1 < STATS_BUCKETS && seen + histogram->buckets[bucket] < rank) {
+        seen += histogram->buckets[bucket++];
+    }
+    uint64_t bound = (uint64_t)1 << bucket;
+    return (double)((bound < histogram->max_ns) ? bound : histogram->max_ns) / 1000.0;
+}
+
+static size_t format_line(char* buf, size_t len, size_t pos, const char* kind, const char* name,
+                          const struct histogram* histogram, const char* units) {
+    if (histogram->count == 0) {
+        return pos;
+    }
+    // Only length is counted once buffer is full
+    char* out = (pos < len) ? buf + pos : NULL;
+    size_t left = (pos < len) ? len - pos : 0;
+    int written = snprintf(
+        out, left, "%s %s: count %llu, avg %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us",
+        kind, name, (unsigned long long)histogram->count,
+        (double)histogram->total_ns / (double)histogram->count / 1000.0,
+        percentile_us(histogram, 0.5), percentile_us(histogram, 0.99),
+        (double)histogram->max_ns / 1000.0);
+    pos += (written > 0) ? (size_t)written : 0;
+
+    out = (pos < len) ? buf + pos : NULL;
+    left = (pos < len) ? len - pos : 0;
+    if (units != NULL) {
+        written = snprintf(out, left, ", %s %llu\n", units, (unsigned long long)histogram->units);
+    } else {
+        written = snprintf(out, left, "\n");
+    }
+    return pos + ((written > 0) ? (size_t)written : 0);
+}
+
+size_t stats_format(const struct stats* total, char* buf, size_t len) {
+    size_t pos = 0;
+    if (len > 0) {
+        buf[0] = '\0';
+    }
+    for (size_t op = OP_INVALID + 1; op < OP_COUNT; ++op) {
+        pos = format_line(buf, len, pos, "request", opcode_name((enum opcode)op),
+                          &total->requests[op], NULL);
+    }
+    for (size_t event = 0; event < STATS_EVENT_COUNT; ++event) {
+        pos = format_line(buf, len, pos, "event", event_names[event], &total->events[event],
+                          event_units[event]);
+    }
+    return pos;
+}
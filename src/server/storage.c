@@ -0,0 +1,333 @@
+#define _GNU_SOURCE  // fallocate
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "server/stats.h"
+#include "server/storage.h"
+
+#define ZERO_CHUNK 65536
+
+static const char zero_chunk[ZERO_CHUNK];
+
+// Deallocate range of regular image file, it reads as zeros afterwards
+static int punch_hole(struct storage* storage, off_t offset, size_t len) {
+    return fallocate(storage->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, (off_t)len);
+}
+
+// Page cache of image file is shared by both backends, so data written
+// through the mapping is sent as well
+static ssize_t file_send(struct storage* storage, int out_fd, off_t offset, size_t len) {
+    while (1) {
+        ssize_t sent = sendfile(out_fd, storage->fd, &offset, len);
+        if (sent >= 0 || errno != EINTR) {
+            return sent;
+        }
+    }
+}
+
+static ssize_t pio_read(struct storage* storage, void* buf, size_t len, off_t offset) {
+    size_t pos = 0;
+    while (pos < len) {
+        ssize_t read_bytes = pread(storage->fd, (char*)buf + pos, len - pos, offset + pos);
+        if (read_bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("storage read");
+            return -1;
+        }
+        if (read_bytes == 0) {
+            // Reading past the end of image, rest of the range is zero
+            memset((char*)buf + pos, 0, len - pos);
+            break;
+        }
+        pos += read_bytes;
+    }
+    return (ssize_t)len;
+}
+
+static ssize_t pio_write(struct storage* storage, const void* buf, size_t len, off_t offset) {
+    size_t pos = 0;
+    while (pos < len) {
+        ssize_t written = pwrite(storage->fd, (const char*)buf + pos, len - pos, offset + pos);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("storage write");
+            return -1;
+        }
+        pos += written;
+    }
+    return (ssize_t)len;
+}
+
+static int pio_sync(struct storage* storage) {
+    return fsync(storage->fd);
+}
+
+static void pio_prefetch(struct storage* storage, off_t offset, size_t len) {
+    posix_fadvise(storage->fd, offset, (off_t)len, POSIX_FADV_WILLNEED);
+}
+
+// Devices and filesystems without hole punching get zeros written
+static int pio_discard(struct storage* storage, off_t offset, size_t len) {
+    if (punch_hole(storage, offset, len) == 0) {
+        return 0;
+    }
+    while (len > 0) {
+        size_t part = (len < ZERO_CHUNK) ? len : ZERO_CHUNK;
+        if (pio_write(storage, zero_chunk, part, offset) < 0) {
+            return -1;
+        }
+        offset += part;
+        len -= part;
+    }
+    return 0;
+}
+
+static void pio_close(struct storage* storage) {
+    close(storage->fd);
+    storage->fd = -1;
+}
+
+static const struct storage_ops pio_ops = {.read = pio_read,
+                                           .write = pio_write,
+                                           .sync = pio_sync,
+                                           .prefetch = pio_prefetch,
+                                           .discard = pio_discard,
+                                           .send = file_send,
+                                           .close = pio_close};
+
+static ssize_t mmap_read(struct storage* storage, void* buf, size_t len, off_t offset) {
+    if (offset < 0 || (size_t)offset + len > storage->size) {
+        return -1;
+    }
+    memcpy(buf, storage->map + offset, len);
+    return (ssize_t)len;
+}
+
+static ssize_t mmap_write(struct storage* storage, const void* buf, size_t len, off_t offset) {
+    if (offset < 0 || (size_t)offset + len > storage->size) {
+        return -1;
+    }
+    memcpy(storage->map + offset, buf, len);
+    return (ssize_t)len;
+}
+
+static int mmap_sync(struct storage* storage) {
+    return msync(storage->map, storage->size, MS_SYNC);
+}
+
+static void mmap_prefetch(struct storage* storage, off_t offset, size_t len) {
+    if (offset < 0 || (size_t)offset >= storage->size) {
+        return;
+    }
+    if ((size_t)offset + len > storage->size) {
+        len = storage->size - offset;
+    }
+    // madvise needs page aligned address
+    size_t skip = (size_t)offset % (size_t)sysconf(_SC_PAGESIZE);
+    madvise(storage->map + offset - skip, len + skip, MADV_WILLNEED);
+}
+
+// Shared mapping sees zeros in place of punched hole
+static int mmap_discard(struct storage* storage, off_t offset, size_t len) {
+    if (offset < 0 || (size_t)offset + len > storage->size) {
+        return -1;
+    }
+    if (punch_hole(storage, offset, len) != 0) {
+        memset(storage->map + offset, 0, len);
+    }
+    return 0;
+}
+
+static void mmap_close(struct storage* storage) {
+    munmap(storage->map, storage->size);
+    storage->map = NULL;
+    close(storage->fd);
+    storage->fd = -1;
+}
+
+static const struct storage_ops mmap_ops = {.read = mmap_read,
+                                            .write = mmap_write,
+                                            .sync = mmap_sync,
+                                            .prefetch = mmap_prefetch,
+                                            .discard = mmap_discard,
+                                            .send = file_send,
+                                            .close = mmap_close};
+
+static int memory_sync(struct storage* storage) {
+    (void)storage;
+    return 0;
+}
+
+static void memory_prefetch(struct storage* storage, off_t offset, size_t len) {
+    (void)storage;
+    (void)offset;
+    (void)len;
+}
+
+static int memory_discard(struct storage* storage, off_t offset, size_t len) {
+    if (offset < 0 || (size_t)offset + len > storage->size) {
+        return -1;
+    }
+    memset(storage->map + offset, 0, len);
+    return 0;
+}
+
+// Image is not a regular file, so storage_send never gets here
+static ssize_t memory_send(struct storage* storage, int out_fd, off_t offset, size_t len) {
+    (void)storage;
+    (void)out_fd;
+    (void)offset;
+    (void)len;
+    errno = ENOSYS;
+    return -1;
+}
+
+static void memory_close(struct storage* storage) {
+    munmap(storage->map, storage->size);
+    storage->map = NULL;
+}
+
+static const struct storage_ops memory_ops = {.read = mmap_read,
+                                              .write = mmap_write,
+                                              .sync = memory_sync,
+                                              .prefetch = memory_prefetch,
+                                              .discard = memory_discard,
+                                              .send = memory_send,
+                                              .close = memory_close};
+
+int storage_parse_kind(const char* name, enum storage_kind* kind) {
+    if (strcmp(name, "pio") == 0) {
+        *kind = STORAGE_PIO;
+        return 0;
+    }
+    if (strcmp(name, "mmap") == 0) {
+        *kind = STORAGE_MMAP;
+        return 0;
+    }
+    return -1;
+}
+
+int storage_open(struct storage* storage, const char* path, enum storage_kind kind, size_t size) {
+    memset(storage, 0, sizeof(struct storage));
+    storage->kind = kind;
+    storage->size = size;
+
+    storage->fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (storage->fd < 0) {
+        return -1;
+    }
+
+    struct stat stat_info;
+    if (fstat(storage->fd, &stat_info) < 0) {
+        close(storage->fd);
+        return -1;
+    }
+
+    storage->regular = S_ISREG(stat_info.st_mode);
+    if (storage->regular) {
+        if ((size_t)stat_info.st_size < size) {
+            if (ftruncate(storage->fd, (off_t)size) < 0) {
+                close(storage->fd);
+                return -1;
+            }
+        } else {
+            // Image may be formatted for bigger geometry
+            storage->size = (size_t)stat_info.st_size;
+        }
+    } else {
+        // Driver reports disk size as the end position
+        off_t end = lseek(storage->fd, 0, SEEK_END);
+        if (end > 0 && (size_t)end > size) {
+            storage->size = (size_t)end;
+        }
+    }
+
+    if (kind == STORAGE_PIO) {
+        storage->ops = &pio_ops;
+        return 0;
+    }
+
+    // Character device driver does not implement mmap
+    if (!storage->regular) {
+        close(storage->fd);
+        errno = ENODEV;
+        return -1;
+    }
+
+    storage->map = mmap(NULL, storage->size, PROT_READ | PROT_WRITE, MAP_SHARED, storage->fd, 0);
+    if (storage->map == MAP_FAILED) {
+        storage->map = NULL;
+        close(storage->fd);
+        return -1;
+    }
+    storage->ops = &mmap_ops;
+    return 0;
+}
+
+int storage_open_memory(struct storage* storage, size_t size) {
+    memset(storage, 0, sizeof(struct storage));
+    storage->kind = STORAGE_MEMORY;
+    storage->fd = -1;
+    storage->size = size;
+
+    // Anonymous mapping is zeroed and its pages are taken on first touch
+    storage->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (storage->map == MAP_FAILED) {
+        storage->map = NULL;
+        return -1;
+    }
+    storage->ops = &memory_ops;
+    return 0;
+}
+
+ssize_t storage_read(struct storage* storage, void* buf, size_t len, off_t offset) {
+    uint64_t start = stats_now();
+    ssize_t result = storage->ops->read(storage, buf, len, offset);
+    stats_record(STATS_DEVICE_READ, start, (result > 0) ? (uint64_t)result : 0);
+    return result;
+}
+
+ssize_t storage_write(struct storage* storage, const void* buf, size_t len, off_t offset) {
+    uint64_t start = stats_now();
+    ssize_t result = storage->ops->write(storage, buf, len, offset);
+    stats_record(STATS_DEVICE_WRITE, start, (result > 0) ? (uint64_t)result : 0);
+    return result;
+}
+
+int storage_sync(struct storage* storage) {
+    return storage->ops->sync(storage);
+}
+
+void storage_prefetch(struct storage* storage, off_t offset, size_t len) {
+    storage->ops->prefetch(storage, offset, len);
+}
+
+int storage_discard(struct storage* storage, off_t offset, size_t len) {
+    return storage->ops->discard(storage, offset, len);
+}
+
+ssize_t storage_send(struct storage* storage, int out_fd, off_t offset, size_t len) {
+    if (!storage->regular) {
+        errno = ENOSYS;
+        return -1;
+    }
+    uint64_t start = stats_now();
+    ssize_t sent = storage->ops->send(storage, out_fd, offset, len);
+    stats_record(STATS_DEVICE_READ, start, (sent > 0) ? (uint64_t)sent : 0);
+    return sent;
+}
+
+void storage_close(struct storage* storage) {
+    storage->ops->close(storage);
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common/net_utils.h"
+#include "server/cache.h"
+#include "server/discard.h"
+#include "server/fs.h"
+#include "server/storage.h"
+#include "test.h"
+
+#define FILE_LEN 3000
+#define MAX_WRITES 1000  // more than one transaction of the test takes
+
+// Filesystem code reports errors to the current client
+_Thread_local int client_fd = -1;
+
+// Crash is simulated by storage which takes image snapshot instead of the
+// first write after writes_left ones, and fails that write and all later ones
+static const struct storage_ops* real_ops;
+static struct storage_ops crash_ops;
+static int writes_left;
+static int crashed;
+static char* snapshot;
+
+static ssize_t crash_write(struct storage* storage, const void* buf, size_t len, off_t offset) {
+    if (writes_left == 0) {
+        if (!crashed) {
+            memcpy(snapshot, storage->map, storage->size);
+            crashed = 1;
+        }
+        return -1;
+    }
+    --writes_left;
+    return real_ops->write(storage, buf, len, offset);
+}
+
+static ssize_t fail_write(struct storage* storage, const void* buf, size_t len, off_t offset) {
+    return -1;
+}
+
+static int check_file(char* path, char tag) {
+    struct inode_ref ref;
+    struct inode stat;
+    if (lookup_file(path, &ref, &stat) != 0) {
+        return 0;
+    }
+    char buf[FILE_LEN];
+    CHECK(stat.file_len == FILE_LEN);
+    CHECK(read_range(&ref, 0, buf, sizeof(buf)) == FILE_LEN);
+    for (size_t i = 0; i < FILE_LEN; ++i) {
+        if (buf[i] != tag) {
+            CHECK(buf[i] == tag);
+            break;
+        }
+    }
+    return 1;
+}
+
+static int write_file(char* path, char tag) {
+    char data[FILE_LEN];
+    memset(data, tag, sizeof(data));
+    struct inode_ref ref;
+    if (create_at(path, REG, NULL) != 0 || lookup_file(path, &ref, NULL) != 0) {
+        return -1;
+    }
+    return write_range(&ref, 0, data, sizeof(data));
+}
+
+// Transaction creates directory with a file and removes another file. Crash
+// after the given number of writes leaves either all of it or nothing.
+// Return 1 if the transaction completed before the crash point
+static int crash_at(int writes) {
+    struct storage disk;
+    if (test_format(&disk, 1024, 64, DEFAULT_CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "cannot format image\n");
+        ++test_failures;
+        return 1;
+    }
+    char base[] = "/base";
+    char dir[] = "/d";
+    char file[] = "/d/f";
+    CHECK(write_file(base, 'b') == 0);
+    CHECK(dump_info() == 0);
+
+    snapshot = malloc(disk.size);
+    real_ops = disk.ops;
+    crash_ops = *disk.ops;
+    crash_ops.write = crash_write;
+    writes_left = writes;
+    crashed = 0;
+    disk.ops = &crash_ops;
+
+    fs_batch_begin();
+    create_at(dir, DIR, NULL);
+    write_file(file, 'f');
+    remove_at(base);
+    fs_batch_end();
+
+    disk.ops = real_ops;
+    fs_shutdown();
+    if (crashed) {
+        memcpy(disk.map, snapshot, disk.size);
+    }
+    free(snapshot);
+
+    // Removed file keeps its data until its removal is committed
+    CHECK(fs_mount(&disk, DEFAULT_CACHE_BLOCKS) == 0);
+    int created = check_file(file, 'f');
+    int kept = check_file(base, 'b');
+    CHECK(created != kept);
+    CHECK((find_file(dir) >= 0) == created);
+
+    // Recovered filesystem is usable
+    char after[] = "/after";
+    CHECK(write_file(after, 'a') == 0);
+    CHECK(fs_shutdown() == 0);
+    CHECK(fs_mount(&disk, DEFAULT_CACHE_BLOCKS) == 0);
+    CHECK(check_file(after, 'a'));
+
+    fs_shutdown();
+    storage_close(&disk);
+    return !crashed;
+}
+
+// Operation whose commit fails is reported failed to client
+static void commit_failure() {
+    struct storage disk;
+    if (test_format(&disk, 1024, 64, DEFAULT_CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "cannot format image\n");
+        ++test_failures;
+        return;
+    }
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    client_fd = fds[0];
+    real_ops = disk.ops;
+    crash_ops = *disk.ops;
+    crash_ops.write = fail_write;
+    disk.ops = &crash_ops;
+
+    char path[] = "/f";
+    CHECK(create_at(path, REG, NULL) != 0);
+    CHECK(recv_status(fds[1]) == 0);
+    char message[256];
+    memset(message, 0, sizeof(message));
+    safe_recv(message, fds[1]);
+    CHECK(strstr(message, "commit") != NULL);
+
+    disk.ops = real_ops;
+    close(fds[0]);
+    close(fds[1]);
+    client_fd = -1;
+    fs_shutdown();
+    storage_close(&disk);
+}
+
+int main() {
+    commit_failure();
+    enum discard_mode modes[] = {DISCARD_SYNC, DISCARD_DEFERRED};
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        discard_set_mode(modes[i]);
+        int writes = 0;
+        while (writes < MAX_WRITES && !crash_at(writes)) {
+            ++writes;
+        }
+        CHECK(writes > 0 && writes < MAX_WRITES);
+    }
+    return test_result("crash_test");
+}
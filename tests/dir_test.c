@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server/adapter.h"
+#include "server/cache.h"
+#include "server/fs.h"
+#include "server/storage.h"
+#include "test.h"
+
+// Listing of kept entries is longer than one chunk
+#define ENTRIES 9000
+
+// Filesystem code reports errors to the current client
+_Thread_local int client_fd = -1;
+
+static void entry_path(char* path, size_t size, int i) {
+    snprintf(path, size, "/big/entry%05d", i);
+}
+
+static int is_kept(int i) {
+    return i % 3 != 0;
+}
+
+struct listing {
+    int fd;
+    char* text;
+    size_t len;
+    int result;
+};
+
+// Receive streamed answer of ls while server side is sending it
+static void* read_listing(void* arg) {
+    struct listing* listing = arg;
+    listing->result = -1;
+    if (recv_status(listing->fd) != 1) {
+        return NULL;
+    }
+    size_t capacity = CHUNK_SIZE;
+    listing->text = malloc(capacity + 1);
+    int got;
+    while ((got = recv_chunk(listing->text + listing->len, listing->fd, CHUNK_SIZE)) > 0) {
+        listing->len += (size_t)got;
+        if (capacity - listing->len < CHUNK_SIZE) {
+            capacity *= 2;
+            listing->text = realloc(listing->text, capacity + 1);
+        }
+    }
+    listing->text[listing->len] = '\0';
+    listing->result = got;
+    return NULL;
+}
+
+// Names listed by ls are kept entries in order of directory
+static void check_listing() {
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    struct listing listing = {.fd = fds[1]};
+    pthread_t reader;
+    pthread_create(&reader, NULL, read_listing, &listing);
+
+    struct request request;
+    memset(&request, 0, sizeof(request));
+    request.opcode = OP_LS;
+    request.arg_count = 1;
+    request.args[0] = "/big";
+    request.arg_len[0] = strlen("/big");
+    CHECK(perform_ls(&request, fds[0]) == 0);
+    pthread_join(reader, NULL);
+    close(fds[0]);
+    close(fds[1]);
+
+    CHECK(listing.result == 0);
+    CHECK(listing.len > CHUNK_SIZE);
+    int listed = 0;
+    char* saveptr = NULL;
+    for (char* name = strtok_r(listing.text, "\n", &saveptr); name != NULL;
+         name = strtok_r(NULL, "\n", &saveptr)) {
+        CHECK(strncmp(name, "entry", 5) == 0);
+        ++listed;
+    }
+    int kept = 0;
+    for (int i = 0; i < ENTRIES; ++i) {
+        kept += is_kept(i);
+    }
+    CHECK(listed == kept);
+    free(listing.text);
+}
+
+static void check_entries(int removed) {
+    char path[64];
+    for (int i = 0; i < ENTRIES; ++i) {
+        entry_path(path, sizeof(path), i);
+        CHECK((find_file(path) >= 0) == (!removed || is_kept(i)));
+    }
+}
+
+int main() {
+    struct storage disk;
+    if (test_format(&disk, 4096, ENTRIES + 64, DEFAULT_CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "cannot format image\n");
+        return 1;
+    }
+
+    // Index is built once directory outgrows one block and rebuilt as it grows
+    char dir[] = "/big";
+    CHECK(create_at(dir, DIR, NULL) == 0);
+    char path[64];
+    for (int i = 0; i < ENTRIES; ++i) {
+        entry_path(path, sizeof(path), i);
+        CHECK(create_at(path, REG, NULL) == 0);
+    }
+    struct inode_ref ref;
+    struct inode stat;
+    CHECK(lookup_file(dir, &ref, &stat) == 0);
+    CHECK(stat.index_inode != 0);
+    CHECK(get_inode((int)stat.index_inode)->type == DIR_INDEX);
+    check_entries(0);
+
+    // Removed entries are replaced by the last ones, index follows them
+    for (int i = 0; i < ENTRIES; ++i) {
+        entry_path(path, sizeof(path), i);
+        if (!is_kept(i)) {
+            CHECK(remove_at(path) == 0);
+        }
+    }
+    check_entries(1);
+    check_listing();
+
+    CHECK(fs_shutdown() == 0);
+    CHECK(fs_mount(&disk, DEFAULT_CACHE_BLOCKS) == 0);
+    check_entries(1);
+    check_listing();
+
+    // Removing directory releases its index
+    uint32_t index = stat.index_inode;
+    uint32_t generation = get_inode((int)index)->generation;
+    CHECK(remove_at(dir) == 0);
+    CHECK(get_inode((int)index)->generation != generation);
+
+    fs_shutdown();
+    storage_close(&disk);
+    return test_result("dir_test");
+}
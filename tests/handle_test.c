@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server/adapter.h"
+#include "server/cache.h"
+#include "server/fs.h"
+#include "server/storage.h"
+#include "test.h"
+
+#define FILE_LEN 5000
+
+// Filesystem code reports errors to the current client
+_Thread_local int client_fd = -1;
+
+static int fds[2];
+static char expected[FILE_LEN];
+
+// Status of answer, message of answer with a result is stored to message
+static int answer(int has_result, char* message) {
+    int status = recv_status(fds[1]);
+    if (has_result || status == 0) {
+        char buf[256];
+        memset(buf, 0, sizeof(buf));
+        safe_recv(buf, fds[1]);
+        if (message != NULL) {
+            strcpy(message, buf);
+        }
+    }
+    return status;
+}
+
+static int open_handle(const char* path) {
+    const char* args[] = {path};
+    struct request request;
+    test_request(&request, OP_OPEN, 1, args);
+    perform_open(&request, fds[0]);
+    char message[256];
+    return (answer(1, message) == 1) ? atoi(message) : -1;
+}
+
+static int close_handle(const char* handle) {
+    const char* args[] = {handle};
+    struct request request;
+    test_request(&request, OP_CLOSE, 1, args);
+    perform_close(&request, fds[0]);
+    return answer(0, NULL);
+}
+
+// Read len bytes through handle, return number of bytes read or -1
+static int read_handle(const char* handle, const char* len, char* buf, char* message) {
+    const char* args[] = {handle, len};
+    struct request request;
+    test_request(&request, OP_READ, 2, args);
+    perform_read(&request, fds[0]);
+    if (answer(0, message) != 1) {
+        return -1;
+    }
+    int got = 0;
+    int part;
+    while ((part = recv_chunk(buf + got, fds[1], FILE_LEN - got)) > 0) {
+        got += part;
+    }
+    return (part == 0) ? got : -1;
+}
+
+static int write_handle(const char* handle, const char* data) {
+    const char* args[] = {handle, "local"};
+    struct request request;
+    test_request(&request, OP_WRITE, 2, args);
+    send_chunk(data, fds[1], (int)strlen(data));
+    send_chunk_end(fds[1]);
+    perform_write(&request, fds[0]);
+    return answer(0, NULL);
+}
+
+int main() {
+    struct storage disk;
+    if (test_format(&disk, 1024, 64, DEFAULT_CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "cannot format image\n");
+        return 1;
+    }
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    client_fd = fds[0];
+
+    for (size_t i = 0; i < sizeof(expected); ++i) {
+        expected[i] = (char)('a' + i % 26);
+    }
+    char path[] = "/f";
+    struct inode_ref ref;
+    CHECK(create_at(path, REG, NULL) == 0);
+    CHECK(lookup_file(path, &ref, NULL) == 0);
+    CHECK(write_range(&ref, 0, expected, FILE_LEN) == 0);
+
+    // Handle is needed to open files
+    char message[256];
+    CHECK(open_handle("/f") == -1);
+
+    struct handle_table table;
+    memset(&table, 0, sizeof(table));
+    perform_set_handles(&table);
+    CHECK(open_handle("/f") == 0);
+    CHECK(open_handle("/f") == 1);
+    CHECK(open_handle("/missing") == -1);
+
+    // Every handle has its own offset
+    char buf[FILE_LEN];
+    CHECK(read_handle("0", "100", buf, NULL) == 100 && memcmp(buf, expected, 100) == 0);
+    CHECK(read_handle("0", "100", buf, NULL) == 100 && memcmp(buf, expected + 100, 100) == 0);
+    CHECK(read_handle("1", "50", buf, NULL) == 50 && memcmp(buf, expected, 50) == 0);
+
+    // Write continues from offset of handle and moves it
+    CHECK(write_handle("0", "WXYZ") == 1);
+    memcpy(expected + 200, "WXYZ", 4);
+    CHECK(read_handle("1", "300", buf, NULL) == 300 && memcmp(buf, expected + 50, 300) == 0);
+    CHECK(read_handle("0", "6", buf, NULL) == 6 && memcmp(buf, expected + 204, 6) == 0);
+
+    // Reads stop at end of file
+    CHECK(read_handle("1", "100000", buf, NULL) == FILE_LEN - 350);
+    CHECK(memcmp(buf, expected + 350, FILE_LEN - 350) == 0);
+    CHECK(read_handle("1", "10", buf, NULL) == 0);
+
+    // Closed handle is refused and its number is taken again
+    CHECK(close_handle("0") == 1);
+    CHECK(read_handle("0", "10", buf, message) == -1 && strstr(message, "handle") != NULL);
+    CHECK(close_handle("0") == 0);
+    CHECK(close_handle("99") == 0);
+    CHECK(open_handle("/f") == 0);
+    CHECK(read_handle("0", "10", buf, NULL) == 10 && memcmp(buf, expected, 10) == 0);
+
+    // Handle of removed file does not reach the file which reuses its inode
+    CHECK(remove_at(path) == 0);
+    char other[] = "/g";
+    CHECK(create_at(other, REG, "new owner of inode") == 0);
+    CHECK(read_handle("0", "10", buf, message) == -1 && strstr(message, "removed") != NULL);
+    CHECK(write_handle("0", "data") == 0);
+    CHECK(close_handle("0") == 1);
+    CHECK(close_handle("1") == 1);
+
+    // Table is bounded, as descriptors are
+    for (int i = 0; i < MAX_HANDLES; ++i) {
+        CHECK(open_handle("/g") == i);
+    }
+    CHECK(open_handle("/g") == -1);
+    CHECK(test_drained(fds[1]));
+
+    perform_set_handles(NULL);
+    close(fds[0]);
+    close(fds[1]);
+    client_fd = -1;
+    fs_shutdown();
+    storage_close(&disk);
+    return test_result("handle_test");
+}
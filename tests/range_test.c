@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server/adapter.h"
+#include "server/cache.h"
+#include "server/fs.h"
+#include "server/storage.h"
+#include "test.h"
+
+#define FILE_LEN (10 * TEST_BLOCK_SIZE)
+
+// Filesystem code reports errors to the current client
+_Thread_local int client_fd = -1;
+
+static char expected[FILE_LEN + TEST_BLOCK_SIZE];
+
+static char pattern(size_t i) {
+    return (char)(i % 251);
+}
+
+static void check_content(const struct inode_ref* ref, size_t len) {
+    char buf[sizeof(expected)];
+    struct inode stat;
+    CHECK(stat_file(ref, &stat) == 0 && stat.file_len == len);
+    CHECK(read_range(ref, 0, buf, sizeof(buf)) == (ssize_t)len);
+    CHECK(memcmp(buf, expected, len) == 0);
+}
+
+// write and read commands of adapter, content is short enough to stay in socket
+static void check_commands(const struct inode_ref* ref, const int* fds) {
+    struct request request;
+    char message[256];
+
+    // Content is drained after a bad offset, so the next command is parsed
+    const char* bad[] = {"/f", "x1", "local"};
+    test_request(&request, OP_WRITE, 3, bad);
+    CHECK(send_chunk("zzzz", fds[1], 4) == 0 && send_chunk_end(fds[1]) == 0);
+    CHECK(perform_write(&request, fds[0]) == -1);
+    CHECK(recv_status(fds[1]) == 0);
+    memset(message, 0, sizeof(message));
+    safe_recv(message, fds[1]);
+    CHECK(strstr(message, "offset") != NULL);
+    CHECK(test_drained(fds[1]));
+
+    // Offset past end of file is refused
+    const char* past[] = {"/f", "999999", "local"};
+    test_request(&request, OP_WRITE, 3, past);
+    CHECK(send_chunk("zzzz", fds[1], 4) == 0 && send_chunk_end(fds[1]) == 0);
+    CHECK(perform_write(&request, fds[0]) == -1);
+    CHECK(recv_status(fds[1]) == 0);
+    safe_recv(message, fds[1]);
+    CHECK(test_drained(fds[1]));
+
+    const char* write_args[] = {"/f", "5000", "local"};
+    test_request(&request, OP_WRITE, 3, write_args);
+    CHECK(send_chunk("wxyz", fds[1], 4) == 0 && send_chunk_end(fds[1]) == 0);
+    CHECK(perform_write(&request, fds[0]) == 0);
+    CHECK(recv_status(fds[1]) == 1);
+    memcpy(expected + 5000, "wxyz", 4);
+    check_content(ref, FILE_LEN);
+
+    // Range past end of file is cut
+    const char* read_args[] = {"/f", "4998", "100000"};
+    test_request(&request, OP_READ, 3, read_args);
+    CHECK(perform_read(&request, fds[0]) == 0);
+    CHECK(recv_status(fds[1]) == 1);
+    char buf[FILE_LEN];
+    size_t got = 0;
+    int len;
+    while ((len = recv_chunk(buf + got, fds[1], (int)(sizeof(buf) - got))) > 0) {
+        got += (size_t)len;
+    }
+    CHECK(len == 0 && got == FILE_LEN - 4998);
+    CHECK(memcmp(buf, expected + 4998, got) == 0);
+    CHECK(test_drained(fds[1]));
+}
+
+int main() {
+    struct storage disk;
+    if (test_format(&disk, 1024, 64, DEFAULT_CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "cannot format image\n");
+        return 1;
+    }
+    // Errors of operations are sent to client end of socket pair
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    client_fd = fds[0];
+    for (size_t i = 0; i < sizeof(expected); ++i) {
+        expected[i] = pattern(i);
+    }
+    char path[] = "/f";
+    struct inode_ref ref;
+    CHECK(create_at(path, REG, NULL) == 0);
+    CHECK(lookup_file(path, &ref, NULL) == 0);
+    CHECK(write_range(&ref, 0, expected, FILE_LEN) == 0);
+    CHECK(dump_info() == 0);
+
+    // Write across block boundary dirties only the two blocks it touches
+    char update[100];
+    memset(update, 'u', sizeof(update));
+    size_t dirty = cache_get_stats().dirty;
+    CHECK(write_range(&ref, TEST_BLOCK_SIZE - 50, update, sizeof(update)) == 0);
+    CHECK(cache_get_stats().dirty - dirty == 2);
+    memcpy(expected + TEST_BLOCK_SIZE - 50, update, sizeof(update));
+    check_content(&ref, FILE_LEN);
+
+    // Reads are cut at end of file
+    char buf[TEST_BLOCK_SIZE];
+    CHECK(read_range(&ref, FILE_LEN - 10, buf, sizeof(buf)) == 10);
+    CHECK(memcmp(buf, expected + FILE_LEN - 10, 10) == 0);
+    CHECK(read_range(&ref, FILE_LEN, buf, sizeof(buf)) == 0);
+    CHECK(read_range(&ref, FILE_LEN + 1, buf, sizeof(buf)) == 0);
+
+    // Write may start at end of file, not past it
+    CHECK(write_range(&ref, FILE_LEN + 1, update, sizeof(update)) != 0);
+    CHECK(recv_status(fds[1]) == 0);
+    char message[256];
+    safe_recv(message, fds[1]);
+    struct fs_file file;
+    CHECK(open_file(path, &file, NULL) == 0);
+    CHECK(write_at(&file, FILE_LEN, expected + FILE_LEN, TEST_BLOCK_SIZE) == 0);
+    check_content(&ref, FILE_LEN + TEST_BLOCK_SIZE);
+    CHECK(read_at(&file, 3 * TEST_BLOCK_SIZE + 7, buf, sizeof(buf)) == sizeof(buf));
+    CHECK(memcmp(buf, expected + 3 * TEST_BLOCK_SIZE + 7, sizeof(buf)) == 0);
+    CHECK(truncate_file(&ref, FILE_LEN) == 0);
+
+    check_commands(&ref, fds);
+
+    // File is not created when its content does not fit, its inode stays free
+    char fill[] = "/fill";
+    struct inode_ref fill_ref;
+    CHECK(create_at(fill, REG, NULL) == 0 && lookup_file(fill, &fill_ref, NULL) == 0);
+    uint64_t filled = 0;
+    while (write_range(&fill_ref, filled, expected, TEST_BLOCK_SIZE) == 0) {
+        filled += TEST_BLOCK_SIZE;
+    }
+    CHECK(recv_status(fds[1]) == 0);
+    safe_recv(message, fds[1]);
+    char content[] = "content which does not fit into inode";
+    char created[] = "/c";
+    CHECK(create_at(created, REG, content) != 0);
+    CHECK(recv_status(fds[1]) == 0);
+    safe_recv(message, fds[1]);
+    CHECK(find_file(created) < 0);
+    CHECK(test_drained(fds[1]));
+
+    CHECK(remove_at(fill) == 0);
+    CHECK(create_at(created, REG, content) == 0);
+    struct inode_ref created_ref;
+    CHECK(lookup_file(created, &created_ref, NULL) == 0);
+    CHECK(read_range(&created_ref, 0, buf, sizeof(buf)) == (ssize_t)strlen(content));
+    CHECK(memcmp(buf, content, strlen(content)) == 0);
+    close(fds[0]);
+    close(fds[1]);
+    client_fd = -1;
+
+    CHECK(fs_shutdown() == 0);
+    CHECK(fs_mount(&disk, DEFAULT_CACHE_BLOCKS) == 0);
+    CHECK(lookup_file(path, &ref, NULL) == 0);
+    check_content(&ref, FILE_LEN);
+
+    fs_shutdown();
+    storage_close(&disk);
+    return test_result("range_test");
+}
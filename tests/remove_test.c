@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common/net_utils.h"
+#include "server/cache.h"
+#include "server/fs.h"
+#include "server/storage.h"
+#include "test.h"
+
+// Directory of several blocks with a hash index
+#define ENTRIES 500
+
+// Filesystem code reports errors to the current client
+_Thread_local int client_fd = -1;
+
+// Reads of the block at fail_offset fail
+static const struct storage_ops* real_ops;
+static struct storage_ops fail_ops;
+static off_t fail_offset;
+
+static ssize_t fail_read(struct storage* storage, void* buf, size_t len, off_t offset) {
+    if (offset <= fail_offset && fail_offset < offset + (off_t)len) {
+        return -1;
+    }
+    return real_ops->read(storage, buf, len, offset);
+}
+
+// Disk block holding the given block of file
+static uint32_t file_block(const struct inode* file, uint32_t block) {
+    for (uint32_t i = 0; i < file->extent_count && i < INODE_EXTENTS; ++i) {
+        if (block < file->extents[i].len) {
+            return file->extents[i].start + block;
+        }
+        block -= file->extents[i].len;
+    }
+    return 0;
+}
+
+static void entry_path(char* path, size_t size, int i) {
+    snprintf(path, size, "/d/f%d", i);
+}
+
+static uint32_t dir_blocks(const struct inode* dir) {
+    uint32_t blocks = 0;
+    uint32_t count = (dir->extent_count < INODE_EXTENTS) ? dir->extent_count : INODE_EXTENTS;
+    for (uint32_t i = 0; i < count; ++i) {
+        blocks += dir->extents[i].len;
+    }
+    return blocks;
+}
+
+static struct dir_entry* load_dir(struct inode* stat) {
+    struct inode_ref ref;
+    char dir[] = "/d";
+    if (lookup_file(dir, &ref, stat) != 0) {
+        return NULL;
+    }
+    uint64_t len;
+    return (struct dir_entry*)read_file(&ref, &len);
+}
+
+int main() {
+    struct storage disk;
+    if (test_format(&disk, 4096, ENTRIES + 64, DEFAULT_CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "cannot format image\n");
+        return 1;
+    }
+    char dir[] = "/d";
+    CHECK(create_at(dir, DIR, NULL) == 0);
+    char path[64];
+    for (int i = 0; i < ENTRIES; ++i) {
+        entry_path(path, sizeof(path), i);
+        CHECK(create_at(path, REG, NULL) == 0);
+    }
+
+    // Removal writes the block of entry, not the whole directory: the last
+    // entry takes its place and the index slots of both are updated
+    CHECK(dump_info() == 0);
+    size_t dirty = cache_get_stats().dirty;
+    fs_batch_begin();
+    entry_path(path, sizeof(path), 10);
+    CHECK(remove_at(path) == 0);
+    size_t written = cache_get_stats().dirty - dirty;
+    CHECK(written > 0 && written <= 3);
+    CHECK(fs_batch_end() == 0);
+
+    struct inode stat;
+    struct dir_entry* entries = load_dir(&stat);
+    CHECK(entries != NULL && strcmp(entries[10].name, "f499") == 0);
+    CHECK(stat.file_len == (ENTRIES - 1) * sizeof(struct dir_entry));
+    free(entries);
+    CHECK(find_file(path) < 0);
+    entry_path(path, sizeof(path), ENTRIES - 1);
+    CHECK(find_file(path) >= 0);
+
+    // Block is released once its last entry is gone
+    uint32_t per_block = TEST_BLOCK_SIZE / sizeof(struct dir_entry);
+    uint32_t blocks = dir_blocks(&stat);
+    for (int i = 0; i < ENTRIES - 1; ++i) {
+        entry_path(path, sizeof(path), i);
+        if (i != 10 && i % 2 == 0) {
+            CHECK(remove_at(path) == 0);
+        }
+    }
+    entries = load_dir(&stat);
+    uint32_t count = (uint32_t)(stat.file_len / sizeof(struct dir_entry));
+    CHECK(count == ENTRIES / 2);
+    CHECK(dir_blocks(&stat) == (count + per_block - 1) / per_block);
+    CHECK(dir_blocks(&stat) < blocks);
+    char first[64];
+    snprintf(first, sizeof(first), "/d/%s", entries[0].name);
+    uint32_t last_block = file_block(&stat, (count - 1) / per_block);
+    free(entries);
+
+    // Remaining entries are found, also after remount
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < ENTRIES; ++i) {
+            entry_path(path, sizeof(path), i);
+            CHECK((find_file(path) >= 0) == (i % 2 == 1));
+        }
+        CHECK(fs_shutdown() == 0);
+        CHECK(fs_mount(&disk, DEFAULT_CACHE_BLOCKS) == 0);
+    }
+
+    // Removal fails and cuts nothing when the last entry cannot be moved
+    struct superblock sb;
+    memcpy(&sb, disk.map + SUPERBLOCK_OFFSET, sizeof(sb));
+    struct fs_layout layout;
+    fs_compute_layout(&sb, &layout);
+    fail_offset = layout.data_offset + (off_t)last_block * TEST_BLOCK_SIZE;
+    int fds[2];
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    client_fd = fds[0];
+    real_ops = disk.ops;
+    fail_ops = *disk.ops;
+    fail_ops.read = fail_read;
+    disk.ops = &fail_ops;
+    CHECK(remove_at(first) != 0);
+    disk.ops = real_ops;
+    CHECK(recv_status(fds[1]) == 0);
+    char message[256];
+    safe_recv(message, fds[1]);
+    close(fds[0]);
+    close(fds[1]);
+    client_fd = -1;
+    CHECK(find_file(first) >= 0);
+    entries = load_dir(&stat);
+    CHECK(stat.file_len == count * sizeof(struct dir_entry));
+    free(entries);
+
+    // Emptied directory takes no blocks, names are free again
+    for (int i = 1; i < ENTRIES; i += 2) {
+        entry_path(path, sizeof(path), i);
+        CHECK(remove_at(path) == 0);
+    }
+    entries = load_dir(&stat);
+    CHECK(stat.file_len == 0 && dir_blocks(&stat) == 0);
+    free(entries);
+    entry_path(path, sizeof(path), 1);
+    CHECK(create_at(path, REG, NULL) == 0);
+    CHECK(find_file(path) >= 0);
+
+    fs_shutdown();
+    storage_close(&disk);
+    return test_result("remove_test");
+}
@@ -0,0 +1,138 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server/fs.h"
+#include "server/storage.h"
+#include "test.h"
+
+#define THREADS 8
+#define FILES 150  // per thread, also entries added to the shared directory
+#define MAX_LEN 3000
+#define CACHE_BLOCKS 256
+
+// Filesystem code reports errors to the current client
+_Thread_local int client_fd = -1;
+
+// Content of file i of thread: its tag repeated, lengths cover inline files
+// and files of several blocks
+static size_t file_len(int i) {
+    return (size_t)(i * 37) % MAX_LEN + 1;
+}
+
+static char thread_tag(int thread) {
+    return (char)('a' + thread);
+}
+
+static int is_filled(const char* data, size_t len, char tag) {
+    for (size_t i = 0; i < len; ++i) {
+        if (data[i] != tag) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Each thread fills its own directory and races with the others in /shared:
+// even files are kept, odd ones are removed, files of other threads are read
+static void* worker(void* arg) {
+    int thread = (int)(size_t)arg;
+    char tag = thread_tag(thread);
+    char data[MAX_LEN];
+    char buf[MAX_LEN];
+    memset(data, tag, sizeof(data));
+
+    char path[64];
+    snprintf(path, sizeof(path), "/t%d", thread);
+    CHECK(create_at(path, DIR, NULL) == 0);
+
+    for (int i = 0; i < FILES; ++i) {
+        size_t len = file_len(i);
+        snprintf(path, sizeof(path), "/t%d/f%d", thread, i);
+        CHECK(create_at(path, REG, NULL) == 0);
+
+        struct inode_ref ref;
+        CHECK(lookup_file(path, &ref, NULL) == 0);
+        // Written in two parts, the second one extends the file
+        CHECK(write_range(&ref, 0, data, len / 2) == 0);
+        CHECK(write_range(&ref, len / 2, data, len - len / 2) == 0);
+        CHECK(read_range(&ref, 0, buf, sizeof(buf)) == (ssize_t)len);
+        CHECK(is_filled(buf, len, tag));
+
+        snprintf(path, sizeof(path), "/shared/s%d_%d", thread, i);
+        CHECK(create_at(path, REG, NULL) == 0);
+        if (i % 2 == 1) {
+            CHECK(remove_at(path) == 0);
+            snprintf(path, sizeof(path), "/t%d/f%d", thread, i);
+            CHECK(remove_at(path) == 0);
+        }
+
+        // File of a neighbour is either missing or consistent
+        int other = (thread + 1) % THREADS;
+        snprintf(path, sizeof(path), "/t%d/f%d", other, i);
+        if (lookup_file(path, &ref, NULL) == 0) {
+            ssize_t got = read_range(&ref, 0, buf, sizeof(buf));
+            CHECK(got <= (ssize_t)file_len(i));
+            if (got > 0) {
+                CHECK(is_filled(buf, (size_t)got, thread_tag(other)));
+            }
+        }
+        if (i % 16 == 0) {
+            CHECK(dump_info() == 0);
+        }
+    }
+    return NULL;
+}
+
+// Kept files are found with their content, removed ones are gone
+static void check_tree() {
+    char path[64];
+    char buf[MAX_LEN];
+    for (int thread = 0; thread < THREADS; ++thread) {
+        for (int i = 0; i < FILES; ++i) {
+            int kept = (i % 2 == 0);
+            snprintf(path, sizeof(path), "/shared/s%d_%d", thread, i);
+            CHECK((find_file(path) >= 0) == kept);
+
+            snprintf(path, sizeof(path), "/t%d/f%d", thread, i);
+            struct inode_ref ref;
+            struct inode stat;
+            int found = (lookup_file(path, &ref, &stat) == 0);
+            CHECK(found == kept);
+            if (found) {
+                CHECK(stat.file_len == file_len(i));
+                CHECK(read_range(&ref, 0, buf, sizeof(buf)) == (ssize_t)file_len(i));
+                CHECK(is_filled(buf, file_len(i), thread_tag(thread)));
+            }
+        }
+    }
+}
+
+int main() {
+    struct storage disk;
+    if (test_format(&disk, 16384, 4096, CACHE_BLOCKS) != 0) {
+        fprintf(stderr, "cannot format image\n");
+        return 1;
+    }
+    char shared[] = "/shared";
+    CHECK(create_at(shared, DIR, NULL) == 0);
+
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_create(&threads[i], NULL, worker, (void*)(size_t)i);
+    }
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    check_tree();
+
+    // Everything committed is found again after remount
+    CHECK(fs_shutdown() == 0);
+    CHECK(fs_mount(&disk, CACHE_BLOCKS) == 0);
+    check_tree();
+
+    fs_shutdown();
+    storage_close(&disk);
+    return test_result("stress_test");
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "common/protocol.h"
+#include "server/fs.h"
+#include "server/storage.h"
+
+// Failed check is reported and counted, test goes on to report the others.
+// Checks may run in several threads
+#define CHECK(cond)                                                                  \
+    do {                                                                             \
+        if (!(cond)) {                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            __atomic_add_fetch(&test_failures, 1, __ATOMIC_RELAXED);                 \
+        }                                                                            \
+    } while (0)
+
+static int test_failures;
+
+#define TEST_BLOCK_SIZE 1024
+
+// Format memory image with TEST_BLOCK_SIZE blocks and a journal fitting cache_blocks / 2
+// meta blocks, so dirty metadata is limited only by cache
+static inline int test_format(struct storage* disk, uint32_t block_count, uint32_t inode_count,
+                              size_t cache_blocks) {
+    struct superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.block_size = TEST_BLOCK_SIZE;
+    sb.block_count = block_count;
+    sb.inode_count = inode_count;
+    sb.inode_size = sizeof(struct inode);
+    uint32_t journal_blocks = fs_min_journal_blocks(&sb) + (uint32_t)cache_blocks;
+    sb.journal_blocks = journal_blocks;
+
+    struct fs_layout layout;
+    fs_compute_layout(&sb, &layout);
+    if (storage_open_memory(disk, (size_t)layout.disk_size) != 0) {
+        return -1;
+    }
+    return fs_format(disk, sb.block_size, block_count, inode_count, journal_blocks, cache_blocks);
+}
+
+// Request as parsed by server, args are not copied
+static inline void test_request(struct request* request, enum opcode opcode, size_t arg_count,
+                                const char** args) {
+    memset(request, 0, sizeof(*request));
+    request->opcode = opcode;
+    request->arg_count = arg_count;
+    for (size_t i = 0; i < arg_count; ++i) {
+        request->args[i] = args[i];
+        request->arg_len[i] = strlen(args[i]);
+    }
+}
+
+// Nothing is left unread in socket
+static inline int test_drained(int fd) {
+    char byte;
+    return recv(fd, &byte, 1, MSG_DONTWAIT) == -1 && errno == EAGAIN;
+}
+
+static inline int test_result(const char* name) {
+    if (test_failures != 0) {
+        fprintf(stderr, "%s: %d checks failed\n", name, test_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}